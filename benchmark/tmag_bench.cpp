@@ -0,0 +1,952 @@
+/*
+ * Host side micro benchmarks for the TMAG5170-Q1 library.
+ * Runs on any Linux box, no SPI hardware needed.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#define CRCPP_USE_NAMESPACE
+#define CRCPP_USE_CPP11
+#define CRCPP_INCLUDE_ESOTERIC_CRC_DEFINITIONS
+#include "../library/CRC.h"
+#include "../library/tmag_sensor.h"
+#include "../library/tmag_simulator.h"
+#include "../library/tmag_convert.h"
+#include "../library/tmag_angle.h"
+#include "../library/tmag_async.h"
+#include "../library/tmag_continuous.h"
+#include "../library/tmag_shadow.h"
+#include "../library/tmag_filter.h"
+#include "../library/tmag_calibration.h"
+#include "../library/tmag_capture.h"
+#include "../library/tmag_transport.h"
+#include "../library/tmag_trace.h"
+#include "../library/tmag_latency.h"
+#include "../library/tmag_pipeline.h"
+#include "../library/tmag_shm.h"
+
+using TMAG5170Q1::TMAG5170Q1Device;
+using TMAG5170Q1::TMAG5170Q1DeviceT;
+using TMAG5170Q1::TMAG5170Q1Simulator;
+
+static const int FRAMES = 1 << 16;
+static const int ROUNDS = 64;
+static const std::vector<TMAG5170Q1Device::ADDRESS> XYZT = {
+	TMAG5170Q1Device::X_CH_RESULT, TMAG5170Q1Device::Y_CH_RESULT,
+	TMAG5170Q1Device::Z_CH_RESULT, TMAG5170Q1Device::TEMP_RESULT };
+
+/*
+ * Transport hooks for the default ExternTransport: a stub that answers
+ * with zero frames to measure the host side cost alone, or the register
+ * simulator.
+ */
+static bool simulate = false;
+
+void TMAG_TransferFrame(const uint8_t tx[4], uint8_t rx[4])
+{
+	if (simulate)
+		TMAG5170Q1Simulator::instance().transfer(tx, rx);
+	else
+		memset(rx, 0, 4);
+}
+
+void TMAG_TransferFrames(const uint8_t tx[][4], uint8_t rx[][4], size_t count)
+{
+	if (simulate)
+		TMAG5170Q1Simulator::instance().transfer(tx, rx, count);
+	else
+		memset(rx, 0, 4 * count);
+}
+
+static volatile uint32_t sink;
+
+static uint8_t crc_crcpp(const uint8_t msg[4])
+{
+	uint8_t message[4] = {msg[0], msg[1], msg[2], msg[3]};
+	message[0] ^= 0xF0;
+	return CRCPP::CRC::CalculateBits(message, 24, CRCPP::CRC::CRC_4_ITU(), (unsigned char)0x00);
+}
+
+/* The CRC covers frame bits 0..23, so every possible payload is checked */
+static bool verify_crc()
+{
+	for (uint32_t word = 0; word < (1u << 24); word++) {
+		uint8_t msg[4] = { uint8_t(word), uint8_t(word >> 8), uint8_t(word >> 16), 0 };
+		if (crc_crcpp(msg) != TMAG5170Q1Device::calculate_crc(word)) {
+			printf("crc mismatch for %06x\n", (unsigned int)word);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* The same stub as a compile time transport, inlined into the device */
+struct NullTransport {
+	void transfer(const uint8_t[4], uint8_t rx[4])
+	{
+		memset(rx, 0, 4);
+	}
+	void transfer(const uint8_t[][4], uint8_t rx[][4], size_t count)
+	{
+		memset(rx, 0, 4 * count);
+	}
+};
+
+/*
+ * FrameCodec against the bitfield TXFrame/RXFrame layout. Fields occupy
+ * independent bit ranges, so every value of each range is covered.
+ */
+static bool verify_codec()
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	using TMAG5170Q1::FrameCodec;
+
+	for (uint32_t low = 0; low < (1u << 24); low++) {
+		/* address, rw, data */
+		TMAG5170Q1Device::TXFrame tx;
+		memset(&tx, 0, sizeof(tx));
+		tx.address_ = TMAG5170Q1Device::ADDRESS(low & 0x7F);
+		tx.rw_ = TMAG5170Q1Device::RW((low >> 7) & 0x1);
+		tx.data_.raw_ = uint16_t(low >> 8);
+		uint32_t word;
+		memcpy(&word, &tx, sizeof(word));
+		if (word != (FrameCodec::encode_tx(low & 0x7F, tx.rw_, uint16_t(low >> 8)) & ~FrameCodec::CRC_MASK) ||
+		    FrameCodec::tx_address(word) != tx.address_ || FrameCodec::tx_rw(word) != tx.rw_ ||
+		    FrameCodec::data(word) != tx.data_.raw_) {
+			printf("codec mismatch for tx %06x\n", (unsigned int)low);
+			return false;
+		}
+
+		/* status bits, data */
+		TMAG5170Q1Device::RXFrame rx;
+		memcpy(&rx, &low, sizeof(rx));
+		if (FrameCodec::rx_status(low) != (rx.alert_temp_ | rx.alert_z_ << 1 | rx.alert_y_ << 2 |
+			rx.alert_x_ << 3 | rx.alert_1_ << 4 | rx.alert_0_ << 5 | rx.cfg_reset_ << 6 | rx.prev_crc_status_ << 7) ||
+		    FrameCodec::rx_cfg_reset(low) != rx.cfg_reset_ || FrameCodec::rx_prev_crc_status(low) != rx.prev_crc_status_ ||
+		    FrameCodec::rx_alert_x(low) != rx.alert_x_ || FrameCodec::data(low) != rx.data_.raw_) {
+			printf("codec mismatch for rx %06x\n", (unsigned int)low);
+			return false;
+		}
+	}
+
+	for (uint32_t high = 0; high < 256; high++) {
+		/* crc and command / status nibbles */
+		uint32_t word = high << 24;
+		TMAG5170Q1Device::TXFrame tx;
+		TMAG5170Q1Device::RXFrame rx;
+		memcpy(&tx, &word, sizeof(tx));
+		memcpy(&rx, &word, sizeof(rx));
+		if (FrameCodec::crc(word) != tx.crc_ || FrameCodec::crc(word) != rx.crc_ ||
+		    FrameCodec::tx_start_conversion(word) != tx.cmd0_start_conversion_ ||
+		    FrameCodec::tx_stat012_info(word) != tx.cmd1_data_type_in_stat ||
+		    FrameCodec::rx_stat012(word) != rx.stat012_ ||
+		    FrameCodec::rx_error_status(word) != rx.error_status_) {
+			printf("codec mismatch for %08x\n", (unsigned int)word);
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+/* angle_block and angle_block_scalar against atan2 on a grid over all codes */
+static bool verify_angle()
+{
+	static const int STEP = 97;
+	static int16_t a[65536 / STEP + 1], b[65536 / STEP + 1];
+	static float block[65536 / STEP + 1], scalar[65536 / STEP + 1];
+	const size_t n = sizeof(a) / sizeof(a[0]);
+	double worst = 0;
+	for (size_t i = 0; i < n; i++)
+		a[i] = int16_t(-32768 + int(i) * STEP);
+	for (size_t j = 0; j < n; j++) {
+		for (size_t i = 0; i < n; i++)
+			b[i] = a[j];
+		TMAG5170Q1::angle_block(a, b, n, block, nullptr);
+		TMAG5170Q1::angle_block_scalar(a, b, n, scalar, nullptr);
+		for (size_t i = 0; i < n; i++) {
+			if (a[i] == 0 && b[i] == 0)
+				continue;
+			double exact = std::atan2(double(b[i]), double(a[i])) * 180.0 / M_PI;
+			for (float degrees : { block[i], scalar[i] }) {
+				double error = std::fabs(std::remainder(degrees - exact, 360.0));
+				if (error > worst)
+					worst = error;
+			}
+		}
+	}
+	printf("angle block max error %.4f deg\n", worst);
+	return worst < 0.02;
+}
+
+/*
+ * CalibrationFit on synthetic data: a temperature sweep with known linear
+ * drift, then a distorted, offset sphere of orientations it has to undo
+ */
+static bool verify_calibration_fit()
+{
+	static const double DRIFT[3] = { 0.5, -0.25, 0.125 };
+	static const double OFFSET[3] = { 300, -200, 150 };
+	static const double SOFT[3][3] = { { 1.1, 0.05, 0 }, { 0.05, 0.9, 0.02 }, { 0, 0.02, 1.0 } };
+	static const int POINTS = 2000;
+	static const float FIELD_MT = 10;
+	TMAG5170Q1::CalibrationFit fit;
+	TMAG5170Q1::Calibration c = TMAG5170Q1::Calibration::identity(TMAG5170Q1::Scale{ 1, 1, 1 });
+
+	for (int t = 16000; t < 20000; t += 4)
+		fit.add_drift(int16_t(std::lround(DRIFT[0] * t)), int16_t(std::lround(DRIFT[1] * t)),
+			int16_t(std::lround(DRIFT[2] * t)), int16_t(t));
+	if (!fit.fit_drift(c)) {
+		printf("calibration drift fit failed\n");
+		return false;
+	}
+	double drift_error = 0;
+	for (int a = 0; a < 3; a++)
+		drift_error = std::max(drift_error, std::fabs(c.drift_[a] - DRIFT[a]));
+
+	/* evenly spread orientations, 10000 codes of field, all at t_ref */
+	static int16_t p[3][POINTS], temp[POINTS];
+	static float out[3][POINTS];
+	for (int i = 0; i < POINTS; i++) {
+		double z = 1 - 2 * (i + 0.5) / POINTS;
+		double r = std::sqrt(1 - z * z);
+		double phi = i * M_PI * (3 - std::sqrt(5.0));
+		double u[3] = { r * std::cos(phi), r * std::sin(phi), z };
+		for (int a = 0; a < 3; a++)
+			p[a][i] = int16_t(std::lround(OFFSET[a] + 10000 * (SOFT[a][0] * u[0] + SOFT[a][1] * u[1] + SOFT[a][2] * u[2])));
+		temp[i] = int16_t(std::lround(c.t_ref_));
+		fit.add_iron(c, p[0][i], p[1][i], p[2][i], temp[i]);
+	}
+	if (!fit.fit_iron(c, FIELD_MT)) {
+		printf("calibration iron fit failed\n");
+		return false;
+	}
+	double offset_error = 0, field_error = 0;
+	for (int a = 0; a < 3; a++)
+		offset_error = std::max(offset_error, std::fabs(c.offset_[a] - OFFSET[a]));
+	c.apply(p[0], p[1], p[2], temp, POINTS, out[0], out[1], out[2]);
+	for (int i = 0; i < POINTS; i++) {
+		double b = std::sqrt(out[0][i] * out[0][i] + out[1][i] * out[1][i] + out[2][i] * out[2][i]);
+		field_error = std::max(field_error, std::fabs(b - FIELD_MT) / FIELD_MT);
+	}
+	printf("calibration fit drift error %.5f offset error %.2f codes field error %.4f%%\n",
+		drift_error, offset_error, 100 * field_error);
+	return drift_error < 1e-3 && offset_error < 1 && field_error < 1e-3;
+}
+
+/* checks that don't stop the run print what went wrong, main() then fails */
+static int failures = 0;
+
+static bool check(bool ok, const char *fmt, ...)
+{
+	if (!ok) {
+		va_list args;
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+		failures++;
+	}
+	return ok;
+}
+
+/* f runs one round and returns the number of SPI frames (or samples) it covered */
+template <typename F>
+static void run(const char *name, F f, const char *unit = "frame")
+{
+	double frames = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < ROUNDS; round++)
+		frames += f();
+	auto stop = std::chrono::steady_clock::now();
+
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	printf("%-40s %8.2f ns/%s %12.0f %ss/s\n", name, ns / frames, unit, frames * 1e9 / ns, unit);
+}
+
+template <class Device>
+static void bench_device(const char *transport)
+{
+	static const int CALLS = FRAMES / 8;
+	Device dev;
+	char name[64];
+
+	TMAG5170Q1Device::Data data;
+	data.threshold_.low_ = 10;
+	data.threshold_.high_ = 20;
+	snprintf(name, sizeof(name), "write_data %s", transport);
+	run(name, [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.write_data(TMAG5170Q1Device::X_THRX_CONFIG, data);
+		return CALLS;
+	});
+
+	snprintf(name, sizeof(name), "read_data %s", transport);
+	run(name, [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.read_data(TMAG5170Q1Device::X_CH_RESULT);
+		return 2 * CALLS;
+	});
+
+	snprintf(name, sizeof(name), "read_pipelined %s", transport);
+	run(name, [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.read_pipelined(TMAG5170Q1Device::X_CH_RESULT);
+		dev.flush();
+		return CALLS + 1;
+	});
+
+	snprintf(name, sizeof(name), "read_data xyzt batch %s", transport);
+	run(name, [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.read_data(XYZT);
+		return CALLS * int(XYZT.size() + 1);
+	});
+
+	/* the same sample as four separate register reads */
+	snprintf(name, sizeof(name), "read_data xyzt single %s", transport);
+	run(name, [&] {
+		for (int i = 0; i < CALLS; i++)
+			for (auto address : XYZT)
+				dev.read_data(address);
+		return CALLS * int(2 * XYZT.size());
+	});
+}
+
+/* X/Y/Z and TEMP converting on the simulator timer, it powers up in configuration mode */
+template <class Device>
+static void start_measuring(Device &dev)
+{
+	TMAG5170Q1Device::Data sensor_config, device_config;
+	sensor_config.raw_ = 0;
+	sensor_config.sensor_config_.mag_ch_en_ = TMAG5170Q1Device::MAG_CH_XYZ;
+	device_config.raw_ = 0;
+	device_config.device_config_.operating_mode_ = TMAG5170Q1Device::ACTIVE_MEASURE_MODE;
+	device_config.device_config_.t_ch_en_ = 1;
+	dev.write_data({ TMAG5170Q1Device::SENSOR_CONFIG, TMAG5170Q1Device::DEVICE_CONFIG },
+		{ sensor_config, device_config });
+}
+
+/* records a simulator session, then replays it through the same read path */
+static void bench_replay()
+{
+	typedef TMAG5170Q1::RecordingTransport<TMAG5170Q1::SimulatedTransport> Recorder;
+	static const int SAMPLES = FRAMES / 8;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::TMAG5170Q1DeviceT<Recorder> live{Recorder(TMAG5170Q1::SimulatedTransport(sim))};
+	TMAG5170Q1::Sample sample;
+	TMAG5170Q1::SetCountTracker last;
+	start_measuring(live);
+	live.transport_.clear();
+	for (int i = 0; i < SAMPLES; i++)
+		TMAG5170Q1::read_sample(live, sample, last);
+	const std::vector<TMAG5170Q1::FrameRecord> &records = live.transport_.records();
+
+	/* the configuration is not replayed, read_sample still needs its conversion period */
+	TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::ReplayTransport> dev{TMAG5170Q1::ReplayTransport(records, true)};
+	dev.datamem[TMAG5170Q1Device::DEVICE_CONFIG] = live.datamem[TMAG5170Q1Device::DEVICE_CONFIG];
+	dev.datamem[TMAG5170Q1Device::SENSOR_CONFIG] = live.datamem[TMAG5170Q1Device::SENSOR_CONFIG];
+	last = TMAG5170Q1::SetCountTracker();
+	run("read_sample replay", [&] {
+		for (int i = 0; i < SAMPLES; i++)
+			TMAG5170Q1::read_sample(dev, sample, last);
+		return (int)records.size();
+	});
+	check(!dev.transport_.mismatches() && !live.transport_.dropped(),
+		"replay diverged from recording: %llu frames, %llu not recorded\n",
+		(unsigned long long)dev.transport_.mismatches(), (unsigned long long)live.transport_.dropped());
+}
+
+/* on-chip angle engine, two frames per position */
+static void bench_angle()
+{
+	static const int CALLS = FRAMES / 8;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport> dev{TMAG5170Q1::SimulatedTransport(sim)};
+	TMAG5170Q1::AngleAcquisition<decltype(dev)> rotary(dev);
+	rotary.configure(TMAG5170Q1Device::ANGLE_XY);
+	TMAG5170Q1::AngleSample sample = {};
+	int positions = 0;
+	run("angle acquisition poll", [&] {
+		for (int i = 0; i < CALLS; i++)
+			positions += rotary.poll(sample);
+		return 2 * CALLS;
+	});
+	/* the simulated field is 20 mT rotating in XY */
+	check(positions != 0 && sample.magnitude_ != 0, "angle acquisition returned no position\n");
+}
+
+/*
+ * Triggered conversions, four frames per cycle. A cycle takes 12.8 us of
+ * simulated time and a conversion 100 us, so most cycles find no new one.
+ */
+static void bench_continuous()
+{
+	static const int CALLS = FRAMES / 8;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport> dev{TMAG5170Q1::SimulatedTransport(sim)};
+	TMAG5170Q1::ContinuousAcquisition<decltype(dev)> acquisition(dev);
+	acquisition.configure();
+	acquisition.start();
+	TMAG5170Q1::Sample sample = {};
+	uint64_t samples = 0, fresh = 0;
+	run("continuous acquisition poll", [&] {
+		for (int i = 0; i < CALLS; i++) {
+			if (acquisition.poll(sample)) {
+				samples++;
+				fresh += sample.fresh_;
+			}
+		}
+		return 4 * CALLS;
+	});
+	acquisition.stop();
+	printf("continuous acquisition %llu samples, %llu fresh\n",
+		(unsigned long long)samples, (unsigned long long)fresh);
+}
+
+/* fresh samples from the streamer thread, popped as they arrive */
+static void bench_streamer()
+{
+	static const uint64_t SAMPLES = FRAMES / 4;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport> dev{TMAG5170Q1::SimulatedTransport(sim)};
+	start_measuring(dev);
+	TMAG5170Q1::SampleStreamer<decltype(dev)> streamer(dev);
+	TMAG5170Q1::Sample sample;
+	uint64_t popped = 0, stale = 0, last_ns = 0, backwards = 0;
+
+	/* drops mean the consumer lost the cpu for a whole ring, likely on a single core */
+	auto start = std::chrono::steady_clock::now();
+	streamer.start();
+	while (popped < SAMPLES) {
+		if (streamer.pop(sample)) {
+			popped++;
+			stale += !sample.fresh_;
+			backwards += sample.timestamp_ns_ < last_ns;
+			last_ns = sample.timestamp_ns_;
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	streamer.stop();
+	auto stop = std::chrono::steady_clock::now();
+
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	printf("%-40s %8.2f ns/sample %12.0f samples/s\n", "sample streamer simulator", ns / SAMPLES, SAMPLES * 1e9 / ns);
+	printf("sample streamer produced %llu dropped %llu duplicate polls %llu\n",
+		(unsigned long long)streamer.produced(), (unsigned long long)streamer.dropped(),
+		(unsigned long long)streamer.duplicates());
+	check(!stale && !backwards && streamer.produced() >= popped + streamer.dropped(),
+		"sample streamer popped %llu stale and %llu out of order samples\n",
+		(unsigned long long)stale, (unsigned long long)backwards);
+}
+
+/* xyzt read batches on the queue worker, one batch prepared while the other runs */
+static void bench_async()
+{
+	static const int CALLS = FRAMES / 64;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::AsyncTransferQueue<TMAG5170Q1::SimulatedTransport> queue{TMAG5170Q1::SimulatedTransport(sim)};
+	std::vector<uint32_t> tx, rx;
+
+	/* a register written through the queue reads back */
+	tx = { TMAG5170Q1::FrameCodec::encode_tx(TMAG5170Q1Device::X_THRX_CONFIG, TMAG5170Q1Device::WRITE, 0x1234) };
+	queue.wait(queue.submit(tx), rx);
+	TMAG5170Q1::make_read_batch({ TMAG5170Q1Device::X_THRX_CONFIG }, tx);
+	queue.wait(queue.submit(tx), rx);
+	check(uint16_t(TMAG5170Q1::read_result(rx, 0)) == 0x1234,
+		"async queue read back %04x\n", (unsigned int)uint16_t(TMAG5170Q1::read_result(rx, 0)));
+
+	TMAG5170Q1::make_read_batch(XYZT, tx);
+	run("async queue xyzt batch", [&] {
+		int ticket = queue.submit(tx);
+		for (int i = 1; i < CALLS; i++) {
+			int next = queue.submit(tx);
+			queue.wait(ticket, rx);
+			ticket = next;
+		}
+		queue.wait(ticket, rx);
+		return CALLS * int(tx.size());
+	});
+
+	std::atomic<int> done{0};
+	run("async queue xyzt callback", [&] {
+		for (int i = 0; i < CALLS; i++)
+			queue.submit(tx, [&](const std::vector<uint32_t> &, const std::vector<uint32_t> &) { done++; });
+		while (queue.in_flight())
+			std::this_thread::yield();
+		return CALLS * int(tx.size());
+	});
+	check(done.load() == CALLS * ROUNDS, "async queue ran %d of %d callbacks\n", done.load(), CALLS * ROUNDS);
+}
+
+/* the simulator transport, counting the frames that go out */
+struct CountingTransport : TMAG5170Q1::SimulatedTransport {
+	explicit CountingTransport(TMAG5170Q1::TMAG5170Q1Simulator &sim) : TMAG5170Q1::SimulatedTransport(sim) {}
+	void transfer(const uint8_t tx[4], uint8_t rx[4])
+	{
+		frames_++;
+		TMAG5170Q1::SimulatedTransport::transfer(tx, rx);
+	}
+	void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count)
+	{
+		frames_ += count;
+		TMAG5170Q1::SimulatedTransport::transfer(tx, rx, count);
+	}
+	uint64_t frames_ = 0;
+};
+
+/*
+ * Polls back to back against conversions every 50 us, simulated time only
+ * passes with the frames. Each duplicate poll costs one frame, a fresh one five.
+ */
+static void bench_set_count()
+{
+	static const int POLLS = 1000;
+	static const uint64_t FRAME_NS = 3200;
+	static const uint64_t CONVERSION_NS = 50000;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	sim.set_timing(FRAME_NS, CONVERSION_NS);
+	TMAG5170Q1::TMAG5170Q1DeviceT<CountingTransport> dev{CountingTransport(sim)};
+	start_measuring(dev);
+	TMAG5170Q1::Sample sample;
+	TMAG5170Q1::SetCountTracker last;
+	uint64_t start = dev.transport_.frames_;
+	int fresh = 0;
+	for (int i = 0; i < POLLS; i++)
+		fresh += TMAG5170Q1::read_sample(dev, sample, last);
+	uint64_t frames = dev.transport_.frames_ - start;
+	printf("read_sample %d polls: %llu frames (%d without SET_COUNT), %d samples of %llu conversions\n",
+		POLLS, (unsigned long long)frames, 5 * POLLS, fresh,
+		(unsigned long long)(frames * FRAME_NS / CONVERSION_NS));
+}
+
+/*
+ * Writes only what changed: a flush with nothing dirty sends no frame, a
+ * power on reset brings every configured register back.
+ */
+static void bench_shadow()
+{
+	static const int CALLS = FRAMES / 8;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::TMAG5170Q1DeviceT<CountingTransport> dev{CountingTransport(sim)};
+	TMAG5170Q1::RegisterShadow<decltype(dev)> shadow(dev);
+	shadow.edit(TMAG5170Q1Device::SENSOR_CONFIG).sensor_config_.mag_ch_en_ = TMAG5170Q1Device::MAG_CH_XYZ;
+	shadow.edit(TMAG5170Q1Device::X_THRX_CONFIG).threshold_.high_ = 20;
+	shadow.edit(TMAG5170Q1Device::DEVICE_CONFIG).device_config_.operating_mode_ = TMAG5170Q1Device::ACTIVE_MEASURE_MODE;
+	size_t first = shadow.flush();
+	size_t clean = shadow.flush();
+	sim.reset();
+	dev.read_data(TMAG5170Q1Device::CONV_STATUS);
+	size_t after_reset = shadow.flush();
+	check(first == 3 && clean == 0 && after_reset == 3,
+		"shadow flushed %zu, %zu and %zu registers\n", first, clean, after_reset);
+
+	uint64_t frames = dev.transport_.frames_;
+	run("shadow flush one change", [&] {
+		for (int i = 0; i < CALLS; i++) {
+			shadow.edit(TMAG5170Q1Device::X_THRX_CONFIG).threshold_.high_ = int8_t(i);
+			shadow.flush();
+		}
+		return CALLS;
+	});
+	check(dev.transport_.frames_ - frames == uint64_t(CALLS) * ROUNDS,
+		"shadow sent %llu frames for %d single changes\n",
+		(unsigned long long)(dev.transport_.frames_ - frames), CALLS * ROUNDS);
+}
+
+/* raw frame ring on the inline simulator, every record it keeps must still pass its CRCs */
+static void bench_trace()
+{
+	typedef TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport, TMAG5170Q1::BinaryTrace<4096> > Device;
+	static const int CALLS = FRAMES / 8;
+	static Device dev;
+	start_measuring(dev);
+	dev.trace_.clear();
+
+	run("read_data xyzt batch binary trace", [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.read_data(XYZT);
+		return CALLS * int(XYZT.size() + 1);
+	});
+	size_t bad = 0;
+	for (size_t i = 0; i < dev.trace_.size(); i++)
+		bad += !TMAG5170Q1::FrameCodec::crc_ok(dev.trace_[i].tx_) || !TMAG5170Q1::FrameCodec::crc_ok(dev.trace_[i].rx_);
+	check(dev.trace_.size() + dev.trace_.dropped() == uint64_t(CALLS) * ROUNDS * (XYZT.size() + 1) && !bad,
+		"binary trace kept %zu dropped %llu, %zu with a bad crc\n", dev.trace_.size(),
+		(unsigned long long)dev.trace_.dropped(), bad);
+}
+
+/* per-phase timing of the inline simulator, also shows what the trace costs */
+static void bench_latency()
+{
+	typedef TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport, TMAG5170Q1::LatencyTrace<> > Device;
+	static const int CALLS = FRAMES / 8;
+	static Device dev;
+
+	run("read_data latency trace", [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.read_data(TMAG5170Q1Device::X_CH_RESULT);
+		return 2 * CALLS;
+	});
+	dev.trace_.print(stdout);
+	dev.trace_.reset();
+
+	run("read_data xyzt batch latency trace", [&] {
+		for (int i = 0; i < CALLS; i++)
+			dev.read_data(XYZT);
+		return CALLS * int(XYZT.size() + 1);
+	});
+	dev.trace_.print(stdout);
+}
+
+/* stop() with both rings full and a slow sink has to drain without drops */
+static bool verify_pipeline_drain()
+{
+	static const int ITEMS = 64;
+	TMAG5170Q1::Pipeline<int, int, 8> pipeline;
+	TMAG5170Q1::PipelineConfig config;
+	config.acquired_overflow_ = TMAG5170Q1::BLOCK;
+	int next = 0;
+	int sunk = 0;
+	bool started = pipeline.start(config,
+		[&](int &v) {
+			if (next == ITEMS) {
+				std::this_thread::yield();
+				return false;
+			}
+			v = next++;
+			return true;
+		},
+		[&](const int &in, int &out) { out = in; return true; },
+		[&](const int &) {
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			sunk++;
+		});
+	if (!started) {
+		perror(pipeline.error());
+		return false;
+	}
+	while (pipeline.stats().processed_queued_ < 8)
+		std::this_thread::yield();
+	pipeline.stop();
+	TMAG5170Q1::Pipeline<int, int, 8>::Stats stats = pipeline.stats();
+	if (stats.acquired_dropped_ || stats.processed_dropped_ || stats.sunk_ != stats.acquired_ || sunk != (int)stats.sunk_) {
+		printf("pipeline stop dropped %llu+%llu, sunk %llu of %llu\n",
+			(unsigned long long)stats.acquired_dropped_, (unsigned long long)stats.processed_dropped_,
+			(unsigned long long)stats.sunk_, (unsigned long long)stats.acquired_);
+		return false;
+	}
+	return true;
+}
+
+/* simulator reads, calibration and a counting sink on three threads */
+static void bench_pipeline()
+{
+	struct Field {
+		uint64_t timestamp_ns_;
+		float x_, y_, z_;
+	};
+	static const uint64_t SAMPLES = FRAMES / 4;
+	TMAG5170Q1::TMAG5170Q1Simulator sim;
+	TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport> dev{TMAG5170Q1::SimulatedTransport(sim)};
+	TMAG5170Q1Device::Data sensor_config;
+	sensor_config.raw_ = 0;
+	TMAG5170Q1::Calibration calibration = TMAG5170Q1::Calibration::identity(TMAG5170Q1::scale_from(sensor_config));
+	start_measuring(dev);
+	TMAG5170Q1::Pipeline<TMAG5170Q1::Sample, Field, 256> pipeline;
+	/* the simulator answers at once, nothing paces acquire, so measure with back-pressure */
+	TMAG5170Q1::PipelineConfig config;
+	config.acquired_overflow_ = TMAG5170Q1::BLOCK;
+	uint64_t produced = 0;
+	uint64_t consumed = 0;
+	TMAG5170Q1::SetCountTracker last;
+
+	auto start = std::chrono::steady_clock::now();
+	bool started = pipeline.start(config,
+		[&](TMAG5170Q1::Sample &s) {
+			if (produced == SAMPLES || !TMAG5170Q1::read_sample(dev, s, last))
+				return false;
+			produced++;
+			return true;
+		},
+		[&](const TMAG5170Q1::Sample &s, Field &f) {
+			f.timestamp_ns_ = s.timestamp_ns_;
+			calibration.apply_scalar(&s.x_, &s.y_, &s.z_, &s.temp_, 1, &f.x_, &f.y_, &f.z_);
+			return true;
+		},
+		[&](const Field &) { consumed++; });
+	if (!started) {
+		perror(pipeline.error());
+		failures++;
+		return;
+	}
+	while (pipeline.stats().acquired_ < SAMPLES)
+		std::this_thread::yield();
+	pipeline.stop();
+	auto stop = std::chrono::steady_clock::now();
+
+	double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+	TMAG5170Q1::Pipeline<TMAG5170Q1::Sample, Field, 256>::Stats stats = pipeline.stats();
+	printf("%-40s %8.2f ns/sample %12.0f samples/s\n", "pipeline simulator", ns / SAMPLES, SAMPLES * 1e9 / ns);
+	printf("pipeline sunk %llu/%llu dropped %llu+%llu blocked %llu\n",
+		(unsigned long long)consumed, (unsigned long long)stats.acquired_,
+		(unsigned long long)stats.acquired_dropped_, (unsigned long long)stats.processed_dropped_,
+		(unsigned long long)(stats.acquired_blocked_ + stats.processed_blocked_));
+	check(!stats.acquired_dropped_ && consumed + stats.processed_dropped_ == stats.acquired_,
+		"pipeline lost %llu samples\n",
+		(unsigned long long)(stats.acquired_ - consumed - stats.processed_dropped_));
+}
+
+int main()
+{
+	static uint8_t frames[FRAMES][4];
+	srand(1);
+	for (int i = 0; i < FRAMES; i++)
+		for (int j = 0; j < 4; j++)
+			frames[i][j] = rand();
+
+	if (!verify_crc() || !verify_codec() || !verify_angle() || !verify_calibration_fit() ||
+	    !verify_pipeline_drain())
+		return 1;
+
+	run("crc crcpp CalculateBits", [&] {
+		uint32_t acc = 0;
+		for (int i = 0; i < FRAMES; i++)
+			acc += crc_crcpp(frames[i]);
+		sink = acc;
+		return FRAMES;
+	});
+
+	run("crc nibble table", [&] {
+		uint32_t acc = 0;
+		for (int i = 0; i < FRAMES; i++)
+			acc += TMAG5170Q1Device::calculate_crc(TMAG5170Q1Device::to_word(frames[i]));
+		sink = acc;
+		return FRAMES;
+	});
+
+	run("txframe encode", [&] {
+		uint32_t acc = 0;
+		for (int i = 0; i < FRAMES; i++) {
+			TMAG5170Q1Device::TXFrame tx;
+			memset(&tx, 0, sizeof(tx));
+			tx.rw_ = TMAG5170Q1Device::READ;
+			tx.address_ = TMAG5170Q1Device::ADDRESS(frames[i][0] & 0x1F);
+			tx.data_.result_.value_ = int16_t(frames[i][1] | (frames[i][2] << 8));
+			tx.crc_ = TMAG5170Q1Device::calculate_crc(reinterpret_cast<uint8_t *>(&tx));
+			uint32_t word;
+			memcpy(&word, &tx, sizeof(word));
+			acc += word;
+		}
+		sink = acc;
+		return FRAMES;
+	});
+
+	run("codec encode_tx", [&] {
+		uint32_t acc = 0;
+		for (int i = 0; i < FRAMES; i++)
+			acc += TMAG5170Q1::FrameCodec::encode_tx(frames[i][0] & 0x1F, TMAG5170Q1Device::READ,
+				uint16_t(frames[i][1] | (frames[i][2] << 8)));
+		sink = acc;
+		return FRAMES;
+	});
+
+	run("rxframe decode", [&] {
+		uint32_t acc = 0;
+		for (int i = 0; i < FRAMES; i++) {
+			TMAG5170Q1Device::RXFrame rx;
+			memcpy(&rx, frames[i], sizeof(rx));
+			acc += rx.data_.result_.value_ + rx.prev_crc_status_ + rx.cfg_reset_ +
+				rx.stat012_ + rx.error_status_ +
+				(rx.crc_ == TMAG5170Q1Device::calculate_crc(frames[i]));
+		}
+		sink = acc;
+		return FRAMES;
+	});
+
+	run("codec decode rx", [&] {
+		using TMAG5170Q1::FrameCodec;
+		uint32_t acc = 0;
+		for (int i = 0; i < FRAMES; i++) {
+			uint32_t word = TMAG5170Q1Device::to_word(frames[i]);
+			acc += int16_t(FrameCodec::data(word)) + FrameCodec::rx_prev_crc_status(word) +
+				FrameCodec::rx_cfg_reset(word) + FrameCodec::rx_stat012(word) +
+				FrameCodec::rx_error_status(word) + FrameCodec::crc_ok(word);
+		}
+		sink = acc;
+		return FRAMES;
+	});
+
+	static int16_t raw[4][FRAMES];
+	static float out[4][FRAMES];
+	memcpy(raw, frames, sizeof(raw) < sizeof(frames) ? sizeof(raw) : sizeof(frames));
+	TMAG5170Q1Device::Data sensor_config;
+	sensor_config.raw_ = 0;
+	TMAG5170Q1::Scale scale = TMAG5170Q1::scale_from(sensor_config);
+
+	run("convert xyzt scalar", [&] {
+		TMAG5170Q1::convert_field_scalar(raw[0], FRAMES, scale.x_, out[0]);
+		TMAG5170Q1::convert_field_scalar(raw[1], FRAMES, scale.y_, out[1]);
+		TMAG5170Q1::convert_field_scalar(raw[2], FRAMES, scale.z_, out[2]);
+		TMAG5170Q1::convert_temp_scalar(raw[3], FRAMES, out[3]);
+		return FRAMES;
+	}, "sample");
+
+	run("convert xyzt block", [&] {
+		TMAG5170Q1::convert_block(raw[0], raw[1], raw[2], raw[3], FRAMES, scale,
+			out[0], out[1], out[2], out[3]);
+		return FRAMES;
+	}, "sample");
+
+	TMAG5170Q1::Calibration calibration = TMAG5170Q1::Calibration::identity(scale);
+	calibration.matrix_[0][1] = calibration.matrix_[1][0] = 0.01f * scale.x_;
+	run("calibrate xyzt scalar", [&] {
+		calibration.apply_scalar(raw[0], raw[1], raw[2], raw[3], FRAMES, out[0], out[1], out[2]);
+		return FRAMES;
+	}, "sample");
+
+	run("calibrate xyzt block", [&] {
+		calibration.apply(raw[0], raw[1], raw[2], raw[3], FRAMES, out[0], out[1], out[2]);
+		return FRAMES;
+	}, "sample");
+
+	run("angle xy scalar", [&] {
+		TMAG5170Q1::angle_block_scalar(raw[0], raw[1], FRAMES, out[0], out[1]);
+		return FRAMES;
+	}, "sample");
+
+	run("angle xy block", [&] {
+		TMAG5170Q1::angle_block(raw[0], raw[1], FRAMES, out[0], out[1]);
+		return FRAMES;
+	}, "sample");
+
+	/* decimate xyz by 16 */
+	static int16_t dec[3][FRAMES];
+	TMAG5170Q1::XYZFilter<TMAG5170Q1::CicDecimator<3, 16> > cic;
+	run("cic 3x16 xyz fixed", [&] {
+		cic.process(raw[0], raw[1], raw[2], FRAMES, dec[0], dec[1], dec[2]);
+		return FRAMES;
+	}, "sample");
+
+	TMAG5170Q1::Biquad lowpass = TMAG5170Q1::Biquad::lowpass(1000.0f, 25.0f);
+	TMAG5170Q1::XYZFilter<TMAG5170Q1::FixedBiquadCascade<2> > biquad_q;
+	for (TMAG5170Q1::FixedBiquadCascade<2> *f : { &biquad_q.x_, &biquad_q.y_, &biquad_q.z_ }) {
+		f->set_section(0, lowpass);
+		f->set_section(1, lowpass);
+		f->set_ratio(16);
+	}
+	run("biquad 2x16 xyz fixed", [&] {
+		biquad_q.process(raw[0], raw[1], raw[2], FRAMES, dec[0], dec[1], dec[2]);
+		return FRAMES;
+	}, "sample");
+
+	TMAG5170Q1::BiquadCascadeXYZ<2> biquad_f;
+	biquad_f.set_section(0, lowpass);
+	biquad_f.set_section(1, lowpass);
+	biquad_f.set_ratio(16);
+	run("biquad 2x16 xyz float", [&] {
+		biquad_f.process(raw[0], raw[1], raw[2], FRAMES, out[0], out[1], out[2]);
+		return FRAMES;
+	}, "sample");
+
+	TMAG5170Q1::CaptureWriter capture;
+	if (capture.open("tmag_bench.cap", (uint64_t)FRAMES * ROUNDS)) {
+		TMAG5170Q1::Sample sample = {};
+		run("capture append", [&] {
+			for (int i = 0; i < FRAMES; i++) {
+				sample.timestamp_ns_ = i;
+				sample.x_ = raw[0][i];
+				capture.append(sample);
+			}
+			return FRAMES;
+		}, "sample");
+		capture.close();
+
+		/* every round appended the same FRAMES samples */
+		TMAG5170Q1::CaptureReader reader;
+		if (reader.open("tmag_bench.cap")) {
+			uint64_t mismatches = 0;
+			run("capture read", [&] {
+				uint32_t acc = 0;
+				for (const TMAG5170Q1::CaptureRecord &r : reader) {
+					acc += r.x_;
+					mismatches += r.x_ != raw[0][r.timestamp_ns_ % FRAMES];
+				}
+				sink = acc;
+				return (int)reader.size();
+			}, "sample");
+			check(reader.size() == (uint64_t)FRAMES * ROUNDS && !mismatches,
+				"capture read back %llu records, %llu wrong\n",
+				(unsigned long long)reader.size(), (unsigned long long)mismatches);
+			reader.close();
+		} else {
+			perror(reader.error());
+			failures++;
+		}
+		unlink("tmag_bench.cap");
+	} else {
+		perror(capture.error());
+		failures++;
+	}
+
+	TMAG5170Q1::ShmPublisher bus;
+	TMAG5170Q1::ShmSubscriber subscriber;
+	if (bus.open("/tmag_bench", FRAMES) && subscriber.open("/tmag_bench")) {
+		TMAG5170Q1::Sample sample = {};
+		run("shm publish", [&] {
+			for (int i = 0; i < FRAMES; i++) {
+				sample.timestamp_ns_ = i;
+				sample.x_ = raw[0][i];
+				bus.publish(sample);
+			}
+			return FRAMES;
+		}, "sample");
+
+		/* a subscriber keeping up in chunks of 64 */
+		static TMAG5170Q1::Sample received[64];
+		subscriber.seek_latest();
+		run("shm publish+read", [&] {
+			uint32_t acc = 0;
+			for (int i = 0; i < FRAMES; i += 64) {
+				for (int j = 0; j < 64; j++) {
+					sample.x_ = raw[0][i + j];
+					bus.publish(sample);
+				}
+				size_t n = subscriber.read(received, 64);
+				for (size_t j = 0; j < n; j++)
+					acc += received[j].x_;
+			}
+			sink = acc;
+			return FRAMES;
+		}, "sample");
+		check(!subscriber.lost(), "shm subscriber lost %llu samples\n", (unsigned long long)subscriber.lost());
+		subscriber.close();
+		bus.close();
+	} else {
+		perror(*bus.error() ? bus.error() : subscriber.error());
+		failures++;
+	}
+
+	simulate = false;
+	bench_device<TMAG5170Q1Device>("extern stub");
+	bench_device<TMAG5170Q1DeviceT<NullTransport> >("inline stub");
+	simulate = true;
+	bench_device<TMAG5170Q1Device>("extern simulator");
+	bench_device<TMAG5170Q1DeviceT<TMAG5170Q1::SimulatedTransport> >("inline simulator");
+	bench_replay();
+	bench_set_count();
+	bench_shadow();
+	bench_angle();
+	bench_continuous();
+	bench_async();
+	bench_streamer();
+	bench_trace();
+	bench_latency();
+	bench_pipeline();
+
+	return failures ? 1 : 0;
+}
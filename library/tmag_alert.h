@@ -0,0 +1,186 @@
+#ifndef TMAG5170Q1_ALERT
+#define TMAG5170Q1_ALERT
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "tmag_sensor.h"
+#include "tmag_stream.h"
+#include "tmag_convert.h"
+
+namespace TMAG5170Q1 {
+
+// One alert, the sample is read right after the pin fired
+struct AlertEvent {
+    uint64_t edge_ns_;      // edge timestamp from the pin
+    uint8_t axes_;          // rx status alert bits: 0x08 X, 0x04 Y, 0x02 Z, 0x01 TEMP
+    uint16_t conv_status_;
+    Sample sample_;
+};
+
+// THRX_CONFIG threshold for a field level, the device compares it with
+// the top byte of the result code
+inline int8_t threshold_code(float mT, float range) {
+    long code = std::lround(mT * 128.0f / range);
+    return int8_t(code > 127 ? 127 : code < -128 ? -128 : code);
+}
+
+// ALERT_CONFIG threshold alert enables
+ENUM ALERT_AXES {
+    ALERT_X = 0x1,
+    ALERT_Y = 0x2,
+    ALERT_Z = 0x4,
+    ALERT_T = 0x8
+};
+
+// Event driven acquisition: the device converts on its own in
+// WAKE_UP_AND_SLEEP_MODE, compares against the X/Y/Z/T_THRX_CONFIG bands
+// and pulls ALERT when a result leaves its band. The host sleeps in
+// epoll_wait() on the ALERT line and talks to the sensor only when it
+// fired, instead of polling.
+//
+// Pin is the ALERT line:
+//
+//   int fd() const;                 // readable while an edge is queued
+//   bool consume(uint64_t& ns);     // takes one edge off the queue
+//
+// GpioAlertPin (raspberry-pi/gpio_alert.h) uses the gpio character device,
+// SimulatedAlertPin (tmag_simulator.h) follows a TMAG5170Q1Simulator.
+//
+//   AlertMonitor<Device, GpioAlertPin> monitor(dev, pin);
+//   monitor.set_threshold(Device::Z_THRX_CONFIG, -20, 20);
+//   monitor.configure(ALERT_Z, 1, 7);   // Z only, first crossing, 100 ms sleep
+//   AlertEvent e;
+//   while (monitor.wait(e, -1) > 0) { ... }
+template <class Device, class Pin>
+class AlertMonitor {
+public:
+    typedef typename Device::Data Data;
+
+    AlertMonitor(Device& device, Pin& pin) : device_(device), pin_(pin) {}
+
+    AlertMonitor(const AlertMonitor&) = delete;
+    AlertMonitor& operator=(const AlertMonitor&) = delete;
+
+    ~AlertMonitor() {
+        if (epoll_ >= 0) {
+            close(epoll_);
+        }
+    }
+
+    // Band for X/Y/Z/T_THRX_CONFIG, written by configure()
+    void set_threshold(typename Device::ADDRESS thrx, int8_t low, int8_t high) {
+        Data& band = thresholds_[(thrx - Device::X_THRX_CONFIG) & 0x3];
+        band.threshold_.low_ = low;
+        band.threshold_.high_ = high;
+    }
+
+    // Alerts on the ALERT_AXES in axes after count (1..4) consecutive
+    // results outside the band, latched until the event is read. sleeptime
+    // is the SLEEPTIME field of SENSOR_CONFIG, sensor_config selects the
+    // ranges. Returns false with errno set and error() naming the step
+    // that failed.
+    bool configure(unsigned int axes, unsigned int count = 1, unsigned int sleeptime = 0, Data sensor_config = Data()) {
+        if (epoll_ < 0) {
+            epoll_ = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_ < 0) {
+                error_ = "can't create epoll";
+                return false;
+            }
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = 0;
+            if (epoll_ctl(epoll_, EPOLL_CTL_ADD, pin_.fd(), &ev) < 0) {
+                int err = errno;
+                close(epoll_);
+                epoll_ = -1;
+                errno = err;
+                error_ = "can't watch alert pin";
+                return false;
+            }
+        }
+
+        Data alert_config;
+        alert_config.raw_ = 0;
+        alert_config.alert_config_.x_thrx_alrt_ = (axes & ALERT_X) ? 1 : 0;
+        alert_config.alert_config_.y_thrx_alrt_ = (axes & ALERT_Y) ? 1 : 0;
+        alert_config.alert_config_.z_thrx_alrt_ = (axes & ALERT_Z) ? 1 : 0;
+        alert_config.alert_config_.t_thrx_alrt_ = (axes & ALERT_T) ? 1 : 0;
+        alert_config.alert_config_.thrx_count_ = count > 0 ? (count - 1) & 0x3 : 0;
+        alert_config.alert_config_.alert_latch_ = 1;
+
+        sensor_config.sensor_config_.mag_ch_en_ = Device::MAG_CH_XYZ;
+        sensor_config.sensor_config_.sleeptime_ = sleeptime;
+
+        Data device_config;
+        device_config.raw_ = 0;
+        device_config.device_config_.operating_mode_ = Device::WAKE_UP_AND_SLEEP_MODE;
+        device_config.device_config_.t_ch_en_ = (axes & ALERT_T) ? 1 : 0;
+
+        device_.write_data(
+            { Device::X_THRX_CONFIG, Device::Y_THRX_CONFIG, Device::Z_THRX_CONFIG, Device::T_THRX_CONFIG,
+              Device::ALERT_CONFIG, Device::SENSOR_CONFIG, Device::DEVICE_CONFIG },
+            { thresholds_[0], thresholds_[1], thresholds_[2], thresholds_[3],
+              alert_config, sensor_config, device_config });
+        return true;
+    }
+
+    // Sleeps up to timeout_ms (-1 forever) for ALERT. When it fires reads
+    // CONV_STATUS and X/Y/Z/TEMP in one batch, which releases the latched
+    // alert. Returns 1 with event filled, 0 on timeout, -1 on error.
+    int wait(AlertEvent& event, int timeout_ms) {
+        epoll_event ev;
+        int n;
+        do {
+            n = epoll_wait(epoll_, &ev, 1, timeout_ms);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            error_ = "can't wait for alert";
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (!pin_.consume(event.edge_ns_)) {
+            error_ = "can't read alert edge";
+            return -1;
+        }
+
+        static const std::vector<typename Device::ADDRESS> registers = {
+            Device::CONV_STATUS, Device::X_CH_RESULT, Device::Y_CH_RESULT,
+            Device::Z_CH_RESULT, Device::TEMP_RESULT };
+        device_.read_data(registers);
+        event.axes_ = FrameCodec::rx_status(device_.rx_batch_[0]) & 0x0F;
+        event.conv_status_ = device_.datamem[Device::CONV_STATUS].raw_;
+        Sample& s = event.sample_;
+        s.timestamp_ns_ = now_ns();
+        s.x_ = device_.datamem[Device::X_CH_RESULT].result_.value_;
+        s.y_ = device_.datamem[Device::Y_CH_RESULT].result_.value_;
+        s.z_ = device_.datamem[Device::Z_CH_RESULT].result_.value_;
+        s.temp_ = device_.datamem[Device::TEMP_RESULT].result_.value_;
+        s.set_count_ = device_.datamem[Device::CONV_STATUS].conv_status_.set_count_;
+        s.fresh_ = true;
+        events_++;
+        return 1;
+    }
+
+    uint64_t events() const {
+        return events_;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    Device& device_;
+    Pin& pin_;
+    Data thresholds_[4] = { Data(), Data(), Data(), Data() };
+    int epoll_ = -1;
+    uint64_t events_ = 0;
+    const char* error_ = "";
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_ALERT
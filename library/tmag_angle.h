@@ -0,0 +1,85 @@
+#ifndef TMAG5170Q1_ANGLE
+#define TMAG5170Q1_ANGLE
+#include "tmag_sensor.h"
+#include "tmag_stream.h"
+
+namespace TMAG5170Q1 {
+
+struct AngleSample {
+    uint64_t timestamp_ns_; // steady clock
+    uint16_t angle_;        // ANGLE_RESULT, 1/16 degree
+    uint16_t magnitude_;    // MAGNITUDE_RESULT
+
+    float degrees() const {
+        return angle_ * (1.0f / 16);
+    }
+};
+
+// Rotary encoder mode using the on-chip angle engine.
+//
+// configure() enables angle calculation on one axis pair and continuous
+// conversion of just those two channels. Each poll() is one batch of two
+// frames, ANGLE_RESULT and MAGNITUDE_RESULT. The MAGNITUDE answer arrives
+// as the first response of the following poll, so a position update costs
+// two frames instead of the X/Y/Z reads plus flush, one poll late.
+// For captured raw blocks see angle_block() in tmag_convert.h.
+//
+//   AngleAcquisition<TMAG5170Q1Device> rotary(dev);
+//   rotary.configure(TMAG5170Q1Device::ANGLE_XY);
+//   AngleSample s;
+//   if (rotary.poll(s)) { ... s.degrees() ... }
+template <class Device>
+class AngleAcquisition {
+public:
+    typedef typename Device::Data Data;
+
+    explicit AngleAcquisition(Device& device) : device_(device) {
+        tx_.resize(2);
+        tx_[0] = FrameCodec::encode_tx(Device::ANGLE_RESULT, Device::READ, 0);
+        tx_[1] = FrameCodec::encode_tx(Device::MAGNITUDE_RESULT, Device::READ, 0);
+    }
+
+    // sensor_config selects the ranges, both axes of the pair should share one
+    void configure(typename Device::ANGLE_EN axes, unsigned int conv_avg = 0, Data sensor_config = Data()) {
+        static const unsigned int channels[4] = {
+            Device::MAG_CH_XYZ, Device::MAG_CH_XY, Device::MAG_CH_YZ, Device::MAG_CH_XZ };
+        sensor_config.sensor_config_.angle_en_ = axes;
+        sensor_config.sensor_config_.mag_ch_en_ = channels[axes & 0x3];
+
+        Data device_config;
+        device_config.raw_ = 0;
+        device_config.device_config_.conv_avg_ = conv_avg;
+        device_config.device_config_.operating_mode_ = Device::ACTIVE_MEASURE_MODE;
+
+        device_.write_data({ Device::SENSOR_CONFIG, Device::DEVICE_CONFIG }, { sensor_config, device_config });
+        primed_ = false;
+    }
+
+    // Returns true when sample holds an angle/magnitude pair
+    bool poll(AngleSample& sample) {
+        tx_batch_ = tx_;
+        std::vector<uint32_t>& rx = device_.rx_batch_;
+        device_.transfer_words(tx_batch_, rx);
+
+        bool complete = primed_;
+        if (complete) {
+            sample = partial_;
+            sample.magnitude_ = FrameCodec::data(rx[0]) & 0xFFF;
+        }
+        partial_.timestamp_ns_ = now_ns();
+        partial_.angle_ = FrameCodec::data(rx[1]) & 0x1FFF;
+        primed_ = true;
+        return complete;
+    }
+
+private:
+    Device& device_;
+    std::vector<uint32_t> tx_;
+    std::vector<uint32_t> tx_batch_;
+    AngleSample partial_ = AngleSample();
+    bool primed_ = false;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_ANGLE
@@ -0,0 +1,245 @@
+#ifndef TMAG5170Q1_ASYNC
+#define TMAG5170Q1_ASYNC
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "tmag_sensor.h"
+#include "tmag_ring.h"
+
+namespace TMAG5170Q1 {
+
+// Asynchronous frame batches on a transport. A worker thread owns the
+// transport and runs the batches in submission order, the submitting
+// thread prepares the next batch meanwhile. Submission goes through a
+// lock-free SPSC ring, so submit() and wait() must always be called from
+// the same thread.
+//
+// Batches live in Depth preallocated slots, the ring carries slot indices.
+// Slot buffers are reserved for max_frames frames, so nothing is
+// allocated per batch up to that size (a callback has to fit the small
+// buffer of std::function). With every slot in use try_submit() fails and
+// submit() sleeps until the worker frees one. The mutex is only taken to
+// wake a sleeping thread.
+//
+// Works on frame words (see FrameCodec), the CRC is set by the queue.
+//
+//   AsyncTransferQueue<SpidevTransport> queue(SpidevTransport(bus, 0));
+//   std::vector<uint32_t> tx, rx;
+//   make_read_batch(addresses, tx);
+//   int ticket = queue.submit(tx);
+//   ... prepare the next batch ...
+//   queue.wait(ticket, rx);
+//   int16_t x = read_result(rx, 0);
+template <class Transport, size_t Depth = 64>
+class AsyncTransferQueue {
+public:
+    typedef std::vector<uint32_t> Words;
+    typedef std::function<void(const Words& tx, const Words& rx)> Callback;
+
+    explicit AsyncTransferQueue(Transport transport = Transport(), size_t max_frames = 64) : transport_(transport) {
+        for (Job& job : jobs_) {
+            job.tx_.reserve(max_frames);
+            job.rx_.reserve(max_frames);
+        }
+        worker_ = std::thread([this] { run(); });
+    }
+
+    ~AsyncTransferQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_.store(false);
+        }
+        wake_.notify_one();
+        worker_.join();
+    }
+
+    // Queues tx, returns the ticket for wait() or -1 when every slot is in use
+    int try_submit(const Words& tx) {
+        return enqueue(acquire(), tx, nullptr);
+    }
+
+    // As try_submit(), sleeping until a slot is free instead of failing
+    int submit(const Words& tx) {
+        return enqueue(acquire_wait(), tx, nullptr);
+    }
+
+    // Runs callback on the worker thread when the batch is done, the slot
+    // is freed after it returns. False when every slot is in use.
+    bool try_submit(const Words& tx, Callback callback) {
+        return enqueue(acquire(), tx, std::move(callback)) >= 0;
+    }
+
+    void submit(const Words& tx, Callback callback) {
+        enqueue(acquire_wait(), tx, std::move(callback));
+    }
+
+    // True once the batch of ticket is done
+    bool ready(int ticket) const {
+        return jobs_[ticket].state_.load(std::memory_order_acquire) == DONE;
+    }
+
+    // Sleeps until the batch of ticket is done, copies its rx words and
+    // frees the slot
+    void wait(int ticket, Words& rx) {
+        Job& job = jobs_[ticket];
+        sleep_until([&job] { return job.state_.load(std::memory_order_acquire) == DONE; });
+        rx.assign(job.rx_.begin(), job.rx_.end());
+        job.state_.store(FREE, std::memory_order_release);
+    }
+
+    // Batches submitted but not yet completed
+    size_t in_flight() const {
+        return submitted_.load(std::memory_order_acquire) - completed_.load(std::memory_order_acquire);
+    }
+
+private:
+    enum { FREE, QUEUED, DONE };
+
+    struct Job {
+        Words tx_;
+        Words rx_;
+        Callback callback_;
+        std::atomic<int> state_{FREE};
+    };
+
+    // Slots are only taken by the submitting thread, the worker and wait()
+    // only ever hand them back
+    int acquire() {
+        for (size_t i = 0; i < Depth; i++) {
+            size_t slot = (next_ + i) % Depth;
+            if (jobs_[slot].state_.load(std::memory_order_acquire) == FREE) {
+                next_ = (slot + 1) % Depth;
+                return int(slot);
+            }
+        }
+        return -1;
+    }
+
+    int acquire_wait() {
+        int slot = acquire();
+        if (slot < 0) {
+            sleep_until([this, &slot] { return (slot = acquire()) >= 0; });
+        }
+        return slot;
+    }
+
+    // waiters_ and the fence in finish() make sure a completion either is
+    // seen by condition or wakes the sleeper
+    template <class Condition>
+    void sleep_until(Condition condition) {
+        if (condition()) {
+            return;
+        }
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, condition);
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    int enqueue(int slot, const Words& tx, Callback callback) {
+        if (slot < 0) {
+            return -1;
+        }
+        Job& job = jobs_[slot];
+        job.tx_.assign(tx.begin(), tx.end());
+        job.callback_ = std::move(callback);
+        job.state_.store(QUEUED, std::memory_order_relaxed);
+        submitted_.fetch_add(1, std::memory_order_release);
+        // never full, there are only Depth slots
+        queue_.push(uint32_t(slot));
+        // pairs with the fence in run(), either we see sleeping_ or the worker sees the job
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_.notify_one();
+        }
+        return slot;
+    }
+
+    void run() {
+        uint32_t slot;
+        while (true) {
+            if (!queue_.pop(slot)) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                sleeping_.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                wake_.wait(lock, [this] { return !queue_.empty() || !running_.load(); });
+                sleeping_.store(false, std::memory_order_relaxed);
+                if (queue_.empty() && !running_.load()) {
+                    return;
+                }
+                continue;
+            }
+            execute(jobs_[slot]);
+        }
+    }
+
+    void execute(Job& job) {
+        Words& tx = job.tx_;
+        Words& rx = job.rx_;
+        rx.resize(tx.size());
+        if (!tx.empty()) {
+            for (uint32_t& word : tx) {
+                word = FrameCodec::to_wire(FrameCodec::with_crc(word));
+            }
+            transport_.transfer(reinterpret_cast<const uint8_t(*)[4]>(tx.data()),
+                reinterpret_cast<uint8_t(*)[4]>(rx.data()), tx.size());
+            for (size_t i = 0; i < tx.size(); i++) {
+                tx[i] = FrameCodec::to_wire(tx[i]);
+                rx[i] = FrameCodec::to_wire(rx[i]);
+            }
+        }
+        if (job.callback_) {
+            job.callback_(tx, rx);
+            finish(job, FREE);
+        } else {
+            finish(job, DONE);
+        }
+    }
+
+    void finish(Job& job, int state) {
+        job.state_.store(state, std::memory_order_release);
+        completed_.fetch_add(1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) != 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_.notify_all();
+        }
+    }
+
+    Transport transport_;
+    Job jobs_[Depth];
+    SPSCRing<uint32_t, Depth> queue_;
+    size_t next_ = 0;
+    std::atomic<bool> running_{true};
+    std::atomic<bool> sleeping_{false};
+    std::atomic<int> waiters_{0};
+    std::atomic<size_t> submitted_{0};
+    std::atomic<size_t> completed_{0};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::thread worker_;
+};
+
+// N+1 read frames for addresses, the extra frame collects the last answer
+inline void make_read_batch(const std::vector<TMAG5170Q1Protocol::ADDRESS>& addresses, std::vector<uint32_t>& tx) {
+    tx.resize(addresses.empty() ? 0 : addresses.size() + 1);
+    for (size_t i = 0; i < tx.size(); i++) {
+        tx[i] = FrameCodec::encode_tx(addresses[i < addresses.size() ? i : i - 1], TMAG5170Q1Protocol::READ, 0);
+    }
+}
+
+// Data of the i:th address of a make_read_batch() batch
+inline int16_t read_result(const std::vector<uint32_t>& rx, size_t i) {
+    return int16_t(FrameCodec::data(rx[i + 1]));
+}
+
+}
+
+#endif //#ifndef TMAG5170Q1_ASYNC
@@ -0,0 +1,450 @@
+#ifndef TMAG5170Q1_CALIBRATION
+#define TMAG5170Q1_CALIBRATION
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include "tmag_sensor.h"
+#include "tmag_convert.h"
+
+namespace TMAG5170Q1 {
+
+// Correction of raw X/Y/Z codes for hard iron offset, soft iron and gain
+// mismatch, and offset drift over temperature:
+//
+//   v = code - offset - drift * (TEMP_RESULT - t_ref)
+//   B = matrix * v                      mT, range scale included
+//
+// Fitting is two passes over captured data. A temperature sweep with the
+// sensor held still gives drift and t_ref (CalibrationFit::add_drift),
+// then rotating it through as many orientations as possible in a steady
+// field gives offset and matrix from an ellipsoid fit (add_iron).
+struct Calibration {
+    float offset_[3];       // codes
+    float drift_[3];        // codes per TEMP_RESULT code
+    float t_ref_;           // TEMP_RESULT code the offset applies at
+    float matrix_[3][3];    // codes to mT
+
+    // Plain range scaling, no correction
+    static Calibration identity(const Scale& scale) {
+        Calibration c;
+        memset(&c, 0, sizeof(c));
+        c.t_ref_ = TEMP_ADC_T0;
+        c.matrix_[0][0] = scale.x_;
+        c.matrix_[1][1] = scale.y_;
+        c.matrix_[2][2] = scale.z_;
+        return c;
+    }
+
+    void apply_scalar(const int16_t* x, const int16_t* y, const int16_t* z, const int16_t* temp, size_t n,
+                      float* out_x, float* out_y, float* out_z) const {
+        for (size_t i = 0; i < n; i++) {
+            float t = uint16_t(temp[i]) - t_ref_;
+            float v[3] = {
+                x[i] - offset_[0] - drift_[0] * t,
+                y[i] - offset_[1] - drift_[1] * t,
+                z[i] - offset_[2] - drift_[2] * t };
+            out_x[i] = matrix_[0][0] * v[0] + matrix_[0][1] * v[1] + matrix_[0][2] * v[2];
+            out_y[i] = matrix_[1][0] * v[0] + matrix_[1][1] * v[1] + matrix_[1][2] * v[2];
+            out_z[i] = matrix_[2][0] * v[0] + matrix_[2][1] * v[1] + matrix_[2][2] * v[2];
+        }
+    }
+
+    // Four samples per step on SSE2/NEON, in place of convert_block() for
+    // the field axes
+    void apply(const int16_t* x, const int16_t* y, const int16_t* z, const int16_t* temp, size_t n,
+               float* out_x, float* out_y, float* out_z) const {
+        size_t i = 0;
+#if defined(TMAG5170Q1_SSE2) || defined(TMAG5170Q1_NEON)
+        const Lanes t_ref = lanes_dup(t_ref_);
+        Lanes offset[3], drift[3], m[3][3];
+        for (int a = 0; a < 3; a++) {
+            offset[a] = lanes_dup(offset_[a]);
+            drift[a] = lanes_dup(drift_[a]);
+            for (int b = 0; b < 3; b++) {
+                m[a][b] = lanes_dup(matrix_[a][b]);
+            }
+        }
+        for (; i + 4 <= n; i += 4) {
+            Lanes t = lanes_sub(lanes_load_u16(temp + i), t_ref);
+            Lanes v[3] = { lanes_load_s16(x + i), lanes_load_s16(y + i), lanes_load_s16(z + i) };
+            for (int a = 0; a < 3; a++) {
+                v[a] = lanes_sub(lanes_sub(v[a], offset[a]), lanes_mul(drift[a], t));
+            }
+            float* out[3] = { out_x + i, out_y + i, out_z + i };
+            for (int a = 0; a < 3; a++) {
+                Lanes r = lanes_add(lanes_add(lanes_mul(m[a][0], v[0]), lanes_mul(m[a][1], v[1])),
+                                    lanes_mul(m[a][2], v[2]));
+                lanes_store(out[a], r);
+            }
+        }
+#endif
+        apply_scalar(x + i, y + i, z + i, temp + i, n - i, out_x + i, out_y + i, out_z + i);
+    }
+
+    // MAG_GAIN_CONFIG for angle mode that scales the second axis of pair
+    // to the first on chip. The calibration is adjusted to expect codes
+    // with that gain applied. Returns gain_selection_ 0 if the correction
+    // is outside what GAIN_VALUE can express.
+    TMAG5170Q1Protocol::Data angle_gain_config(TMAG5170Q1Protocol::ANGLE_EN pair) {
+        static const int axes[4][2] = { { 0, 0 }, { 0, 1 }, { 1, 2 }, { 0, 2 } };
+        int a = axes[pair & 0x3][0];
+        int b = axes[pair & 0x3][1];
+        TMAG5170Q1Protocol::Data data;
+        data.raw_ = 0;
+        if (a == b || matrix_[a][a] == 0.0f) {
+            return data;
+        }
+        float gain = matrix_[b][b] / matrix_[a][a];
+        long value = std::lround(gain * 1024.0f);
+        if (value <= 0 || value > 0x7FF) {
+            return data;
+        }
+        gain = value / 1024.0f;
+        data.mag_gain_config_.gain_value_ = value;
+        data.mag_gain_config_.gain_selection_ = b + 1;
+
+        offset_[b] *= gain;
+        drift_[b] *= gain;
+        for (int r = 0; r < 3; r++) {
+            matrix_[r][b] /= gain;
+        }
+        return data;
+    }
+
+    // Compact form: "TCAL", uint16 version, uint16 size, the 16 floats,
+    // FNV-1a of everything before it. Host byte order.
+    static const size_t SERIALIZED_SIZE = 4 + 2 + 2 + 16 * 4 + 4;
+    static const uint16_t VERSION = 1;
+
+    size_t serialize(uint8_t buffer[SERIALIZED_SIZE]) const {
+        uint16_t version = VERSION;
+        uint16_t size = SERIALIZED_SIZE;
+        memcpy(buffer, "TCAL", 4);
+        memcpy(buffer + 4, &version, 2);
+        memcpy(buffer + 6, &size, 2);
+        memcpy(buffer + 8, offset_, sizeof(offset_));
+        memcpy(buffer + 20, drift_, sizeof(drift_));
+        memcpy(buffer + 32, &t_ref_, sizeof(t_ref_));
+        memcpy(buffer + 36, matrix_, sizeof(matrix_));
+        uint32_t check = fnv1a(buffer, SERIALIZED_SIZE - 4);
+        memcpy(buffer + SERIALIZED_SIZE - 4, &check, 4);
+        return SERIALIZED_SIZE;
+    }
+
+    bool deserialize(const uint8_t* buffer, size_t size) {
+        uint16_t version, stored_size;
+        uint32_t check;
+        if (size < SERIALIZED_SIZE || memcmp(buffer, "TCAL", 4) != 0) {
+            return false;
+        }
+        memcpy(&version, buffer + 4, 2);
+        memcpy(&stored_size, buffer + 6, 2);
+        memcpy(&check, buffer + SERIALIZED_SIZE - 4, 4);
+        if (version != VERSION || stored_size != SERIALIZED_SIZE || check != fnv1a(buffer, SERIALIZED_SIZE - 4)) {
+            return false;
+        }
+        memcpy(offset_, buffer + 8, sizeof(offset_));
+        memcpy(drift_, buffer + 20, sizeof(drift_));
+        memcpy(&t_ref_, buffer + 32, sizeof(t_ref_));
+        memcpy(matrix_, buffer + 36, sizeof(matrix_));
+        return true;
+    }
+
+    // Returns false with errno set on failure
+    bool save(const char* path) const {
+        uint8_t buffer[SERIALIZED_SIZE];
+        serialize(buffer);
+        FILE* f = fopen(path, "wb");
+        if (!f) {
+            return false;
+        }
+        bool ok = fwrite(buffer, sizeof(buffer), 1, f) == 1;
+        int err = errno;
+        if (fclose(f) != 0) {
+            ok = false;
+            err = errno;
+        }
+        errno = err;
+        return ok;
+    }
+
+    bool load(const char* path) {
+        uint8_t buffer[SERIALIZED_SIZE];
+        FILE* f = fopen(path, "rb");
+        if (!f) {
+            return false;
+        }
+        bool ok = fread(buffer, sizeof(buffer), 1, f) == 1 && deserialize(buffer, sizeof(buffer));
+        if (!ok && !ferror(f)) {
+            errno = EINVAL;
+        }
+        int err = errno;
+        fclose(f);
+        errno = err;
+        return ok;
+    }
+
+    static uint32_t fnv1a(const uint8_t* p, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) {
+            h = (h ^ p[i]) * 16777619u;
+        }
+        return h;
+    }
+};
+
+// Accumulates sums for both fits, constant memory however long the
+// capture. Feed add_drift() with the temperature sweep, fit_drift(), then
+// add_iron() with the rotation data, fit_iron().
+class CalibrationFit {
+public:
+    CalibrationFit() {
+        reset();
+    }
+
+    void reset() {
+        memset(drift_sums_, 0, sizeof(drift_sums_));
+        memset(normal_, 0, sizeof(normal_));
+        memset(rhs_, 0, sizeof(rhs_));
+        drift_count_ = 0;
+        iron_count_ = 0;
+    }
+
+    // Sensor still, temperature changing
+    void add_drift(int16_t x, int16_t y, int16_t z, int16_t temp) {
+        double t = uint16_t(temp);
+        double v[3] = { double(x), double(y), double(z) };
+        drift_sums_[0][0] += t;
+        drift_sums_[0][1] += t * t;
+        for (int a = 0; a < 3; a++) {
+            drift_sums_[a + 1][0] += v[a];
+            drift_sums_[a + 1][1] += t * v[a];
+        }
+        drift_count_++;
+    }
+
+    // Linear offset drift per axis against TEMP_RESULT, t_ref is the mean
+    // temperature of the sweep. Returns false without enough spread.
+    bool fit_drift(Calibration& c) const {
+        if (drift_count_ < 2) {
+            return false;
+        }
+        double n = double(drift_count_);
+        double t_mean = drift_sums_[0][0] / n;
+        double t_var = drift_sums_[0][1] / n - t_mean * t_mean;
+        if (t_var < 1.0) {
+            return false;
+        }
+        for (int a = 0; a < 3; a++) {
+            double v_mean = drift_sums_[a + 1][0] / n;
+            double cov = drift_sums_[a + 1][1] / n - t_mean * v_mean;
+            c.drift_[a] = float(cov / t_var);
+        }
+        c.t_ref_ = float(t_mean);
+        return true;
+    }
+
+    // Sensor rotating in a steady field, drift of c is removed first
+    void add_iron(const Calibration& c, int16_t x, int16_t y, int16_t z, int16_t temp) {
+        double t = uint16_t(temp) - c.t_ref_;
+        double p[3] = { x - c.drift_[0] * t, y - c.drift_[1] * t, z - c.drift_[2] * t };
+        // p' A p + 2 b' p = 1, unknowns A00 A11 A22 A01 A02 A12 b0 b1 b2
+        double d[9] = {
+            p[0] * p[0], p[1] * p[1], p[2] * p[2],
+            2 * p[0] * p[1], 2 * p[0] * p[2], 2 * p[1] * p[2],
+            2 * p[0], 2 * p[1], 2 * p[2] };
+        for (int r = 0; r < 9; r++) {
+            for (int k = r; k < 9; k++) {
+                normal_[r][k] += d[r] * d[k];
+            }
+            rhs_[r] += d[r];
+        }
+        iron_count_++;
+    }
+
+    // Least squares ellipsoid through the points, offset_ is its centre and
+    // matrix_ maps it onto a sphere of field_mT. Returns false if the points
+    // don't describe an ellipsoid, usually too few orientations.
+    bool fit_iron(Calibration& c, float field_mT) const {
+        if (iron_count_ < 9) {
+            return false;
+        }
+        double m[9][10];
+        for (int r = 0; r < 9; r++) {
+            for (int k = 0; k < 9; k++) {
+                m[r][k] = k >= r ? normal_[r][k] : normal_[k][r];
+            }
+            m[r][9] = rhs_[r];
+        }
+        double u[9];
+        if (!solve(m, u)) {
+            return false;
+        }
+        double A[3][3] = {
+            { u[0], u[3], u[4] },
+            { u[3], u[1], u[5] },
+            { u[4], u[5], u[2] } };
+        double inv[3][3];
+        if (!invert(A, inv)) {
+            return false;
+        }
+        double centre[3];
+        for (int r = 0; r < 3; r++) {
+            centre[r] = -(inv[r][0] * u[6] + inv[r][1] * u[7] + inv[r][2] * u[8]);
+        }
+        // (p - c)' A (p - c) = 1 + c' A c
+        double s = 1.0;
+        for (int r = 0; r < 3; r++) {
+            for (int k = 0; k < 3; k++) {
+                s += centre[r] * A[r][k] * centre[k];
+            }
+        }
+        if (s <= 0) {
+            return false;
+        }
+        // matrix = field * sqrt(A / s), symmetric square root from the eigenbasis
+        double vectors[3][3];
+        double values[3];
+        for (int r = 0; r < 3; r++) {
+            for (int k = 0; k < 3; k++) {
+                A[r][k] /= s;
+            }
+        }
+        eigen(A, values, vectors);
+        for (int e = 0; e < 3; e++) {
+            if (values[e] <= 0) {
+                return false;
+            }
+            values[e] = std::sqrt(values[e]) * field_mT;
+        }
+        for (int r = 0; r < 3; r++) {
+            c.offset_[r] = float(centre[r]);
+            for (int k = 0; k < 3; k++) {
+                double sum = 0;
+                for (int e = 0; e < 3; e++) {
+                    sum += vectors[r][e] * values[e] * vectors[k][e];
+                }
+                c.matrix_[r][k] = float(sum);
+            }
+        }
+        return true;
+    }
+
+    uint64_t drift_samples() const {
+        return drift_count_;
+    }
+
+    uint64_t iron_samples() const {
+        return iron_count_;
+    }
+
+private:
+    // Gaussian elimination with partial pivoting on [M | rhs]
+    static bool solve(double m[9][10], double u[9]) {
+        for (int col = 0; col < 9; col++) {
+            int pivot = col;
+            for (int r = col + 1; r < 9; r++) {
+                if (std::fabs(m[r][col]) > std::fabs(m[pivot][col])) {
+                    pivot = r;
+                }
+            }
+            if (std::fabs(m[pivot][col]) < 1e-300) {
+                return false;
+            }
+            if (pivot != col) {
+                for (int k = 0; k < 10; k++) {
+                    double tmp = m[col][k];
+                    m[col][k] = m[pivot][k];
+                    m[pivot][k] = tmp;
+                }
+            }
+            for (int r = col + 1; r < 9; r++) {
+                double f = m[r][col] / m[col][col];
+                for (int k = col; k < 10; k++) {
+                    m[r][k] -= f * m[col][k];
+                }
+            }
+        }
+        for (int r = 8; r >= 0; r--) {
+            double sum = m[r][9];
+            for (int k = r + 1; k < 9; k++) {
+                sum -= m[r][k] * u[k];
+            }
+            u[r] = sum / m[r][r];
+        }
+        return true;
+    }
+
+    static bool invert(const double a[3][3], double inv[3][3]) {
+        double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+                   - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+                   + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        if (det == 0) {
+            return false;
+        }
+        for (int r = 0; r < 3; r++) {
+            for (int k = 0; k < 3; k++) {
+                int r1 = (k + 1) % 3, r2 = (k + 2) % 3;
+                int c1 = (r + 1) % 3, c2 = (r + 2) % 3;
+                inv[r][k] = (a[r1][c1] * a[r2][c2] - a[r1][c2] * a[r2][c1]) / det;
+            }
+        }
+        return true;
+    }
+
+    // Cyclic Jacobi for a symmetric 3x3, a is destroyed. vectors holds the
+    // eigenvectors as columns.
+    static void eigen(double a[3][3], double values[3], double vectors[3][3]) {
+        for (int r = 0; r < 3; r++) {
+            for (int k = 0; k < 3; k++) {
+                vectors[r][k] = r == k ? 1.0 : 0.0;
+            }
+        }
+        for (int sweep = 0; sweep < 50; sweep++) {
+            double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+            if (off < 1e-30) {
+                break;
+            }
+            for (int p = 0; p < 2; p++) {
+                for (int q = p + 1; q < 3; q++) {
+                    if (a[p][q] == 0) {
+                        continue;
+                    }
+                    double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                    double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+                    double cs = 1 / std::sqrt(t * t + 1);
+                    double sn = t * cs;
+                    for (int k = 0; k < 3; k++) {
+                        double akp = a[k][p], akq = a[k][q];
+                        a[k][p] = cs * akp - sn * akq;
+                        a[k][q] = sn * akp + cs * akq;
+                    }
+                    for (int k = 0; k < 3; k++) {
+                        double apk = a[p][k], aqk = a[q][k];
+                        a[p][k] = cs * apk - sn * aqk;
+                        a[q][k] = sn * apk + cs * aqk;
+                    }
+                    for (int k = 0; k < 3; k++) {
+                        double vkp = vectors[k][p], vkq = vectors[k][q];
+                        vectors[k][p] = cs * vkp - sn * vkq;
+                        vectors[k][q] = sn * vkp + cs * vkq;
+                    }
+                }
+            }
+        }
+        for (int e = 0; e < 3; e++) {
+            values[e] = a[e][e];
+        }
+    }
+
+    double drift_sums_[4][2];   // t and x/y/z: sum, sum * t
+    double normal_[9][9];       // upper triangle of D'D
+    double rhs_[9];
+    uint64_t drift_count_;
+    uint64_t iron_count_;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_CALIBRATION
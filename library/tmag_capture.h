@@ -0,0 +1,427 @@
+#ifndef TMAG5170Q1_CAPTURE
+#define TMAG5170Q1_CAPTURE
+#include <cerrno>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tmag_sensor.h"
+#include "tmag_stream.h"
+
+namespace TMAG5170Q1 {
+
+inline size_t page_size() {
+    return size_t(sysconf(_SC_PAGESIZE));
+}
+
+// Binary capture file, host byte order (little endian on the Pi):
+//
+//   CaptureHeader  registers at capture start, record count
+//   CaptureRecord  [capacity_], fixed size, count_ of them valid
+//
+// The file is preallocated and mapped a window at a time, appending a
+// sample is a store into the mapping and a bump of count_. Nothing is
+// allocated or written with a syscall per sample, the kernel writes the
+// dirty pages back. The window moves on every CAPTURE_WINDOW_BYTES of
+// records, a munmap() and mmap() in the appending thread.
+
+static const char CAPTURE_MAGIC[8] = { 'T', 'M', 'A', 'G', 'C', 'A', 'P', '1' };
+static const uint32_t CAPTURE_VERSION = 1;
+// Bytes of the file mapped at a time by CaptureWriter and CaptureReader
+static const uint64_t CAPTURE_WINDOW_BYTES = 64 << 20;
+
+struct CaptureHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t record_size_;
+    uint64_t start_ns_;     // steady clock when the file was opened
+    uint64_t capacity_;     // records preallocated
+    uint64_t count_;        // records written
+    uint16_t registers_[TMAG5170Q1Protocol::LAST_ADDRESS];
+    uint8_t reserved_[128 - 40 - 2 * TMAG5170Q1Protocol::LAST_ADDRESS];
+};
+static_assert(sizeof(CaptureHeader) == 128, "Capture header layout");
+
+struct CaptureRecord {
+    uint64_t timestamp_ns_;
+    int16_t x_;
+    int16_t y_;
+    int16_t z_;
+    int16_t temp_;
+    uint8_t set_count_;
+    uint8_t flags_;         // FRESH
+    uint8_t reserved_[6];
+
+    static const uint8_t FRESH = 0x01;
+};
+static_assert(sizeof(CaptureRecord) == 24, "Capture record layout");
+
+class CaptureWriter {
+public:
+    CaptureWriter() = default;
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    ~CaptureWriter() {
+        close();
+    }
+
+    // Creates path with room for capacity records. registers is usually the
+    // device's datamem[], LAST_ADDRESS entries, or nullptr.
+    // Returns false with errno set and error() naming the step that failed,
+    // EFBIG when capacity records don't fit in an off_t.
+    bool open(const char* path, uint64_t capacity, const TMAG5170Q1Protocol::Data* registers = nullptr) {
+        close();
+        if (capacity > max_records()) {
+            error_ = "capture too large for the file offsets";
+            errno = EFBIG;
+            return false;
+        }
+        fd_ = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            error_ = "can't create capture file";
+            return false;
+        }
+        file_bytes_ = sizeof(CaptureHeader) + capacity * sizeof(CaptureRecord);
+        int err = posix_fallocate(fd_, 0, off_t(file_bytes_));
+        if (err != 0) {
+            errno = err;
+            return fail("can't preallocate capture file");
+        }
+        void* map = mmap(nullptr, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            return fail("can't map capture file");
+        }
+        header_ = static_cast<CaptureHeader*>(map);
+        count_ = 0;
+        synced_ = 0;
+        if (!slide(sizeof(CaptureHeader))) {
+            munmap(header_, page_size());
+            header_ = nullptr;
+            return fail(error_);
+        }
+
+        memcpy(header_->magic_, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        header_->version_ = CAPTURE_VERSION;
+        header_->record_size_ = sizeof(CaptureRecord);
+        header_->start_ns_ = now_ns();
+        header_->capacity_ = capacity;
+        header_->count_ = 0;
+        for (int i = 0; i < TMAG5170Q1Protocol::LAST_ADDRESS; i++) {
+            header_->registers_[i] = registers ? registers[i].raw_ : 0;
+        }
+        return true;
+    }
+
+    // Returns false once the file is full, or when the next window could
+    // not be mapped (see error())
+    bool append(const Sample& sample) {
+        if (count_ >= header_->capacity_) {
+            return false;
+        }
+        uint64_t offset = sizeof(CaptureHeader) + count_ * sizeof(CaptureRecord);
+        if (offset + sizeof(CaptureRecord) > window_offset_ + window_bytes_ && !slide(offset)) {
+            return false;
+        }
+        CaptureRecord& r = *reinterpret_cast<CaptureRecord*>(window_ + (offset - window_offset_));
+        r.timestamp_ns_ = sample.timestamp_ns_;
+        r.x_ = sample.x_;
+        r.y_ = sample.y_;
+        r.z_ = sample.z_;
+        r.temp_ = sample.temp_;
+        r.set_count_ = sample.set_count_;
+        r.flags_ = sample.fresh_ ? CaptureRecord::FRESH : 0;
+        header_->count_ = ++count_;
+
+        // Start writeback of each completed chunk so hours of capture don't
+        // pile up as dirty page cache
+        if ((count_ - synced_) * sizeof(CaptureRecord) >= SYNC_BYTES) {
+            sync(false);
+        }
+        return true;
+    }
+
+    // Writes the records so far back. Without wait only starts writeback of
+    // the records since the last sync with sync_file_range(), MS_ASYNC does
+    // nothing on Linux. The header page is rewritten on every append and
+    // left to the final sync, which covers windows already unmapped too.
+    void sync(bool wait = true) {
+        if (!header_) {
+            return;
+        }
+        if (wait) {
+            fdatasync(fd_);
+        } else {
+            uint64_t page = page_size();
+            uint64_t from = (sizeof(CaptureHeader) + synced_ * sizeof(CaptureRecord)) / page * page;
+            uint64_t to = (sizeof(CaptureHeader) + count_ * sizeof(CaptureRecord)) / page * page;
+            if (to > from) {
+                sync_file_range(fd_, off_t(from), off_t(to - from), SYNC_FILE_RANGE_WRITE);
+            }
+        }
+        synced_ = count_;
+    }
+
+    // Syncs, unmaps and trims the file to the records written
+    void close() {
+        if (header_) {
+            sync();
+            munmap(window_, window_bytes_);
+            munmap(header_, page_size());
+            if (ftruncate(fd_, off_t(sizeof(CaptureHeader) + count_ * sizeof(CaptureRecord))) < 0) {
+                error_ = "can't trim capture file";
+            }
+            header_ = nullptr;
+            window_ = nullptr;
+            window_offset_ = 0;
+            window_bytes_ = 0;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    uint64_t size() const {
+        return count_;
+    }
+
+    uint64_t capacity() const {
+        return header_ ? header_->capacity_ : 0;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+    // Records a file can hold before its size overflows off_t
+    static uint64_t max_records() {
+        return (uint64_t(std::numeric_limits<off_t>::max()) - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+    }
+
+private:
+    static const size_t SYNC_BYTES = 4 << 20;
+
+    // Moves the mapped window to start at the page holding offset. Only
+    // WINDOW_BYTES of the file are mapped at a time, so a capture larger
+    // than the address space works on a 32 bit system too.
+    bool slide(uint64_t offset) {
+        if (window_) {
+            munmap(window_, window_bytes_);
+            window_ = nullptr;
+            window_bytes_ = 0;
+        }
+        uint64_t base = offset / page_size() * page_size();
+        uint64_t bytes = file_bytes_ - base < CAPTURE_WINDOW_BYTES ? file_bytes_ - base : CAPTURE_WINDOW_BYTES;
+        void* map = mmap(nullptr, size_t(bytes), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, off_t(base));
+        if (map == MAP_FAILED) {
+            error_ = "can't map capture window";
+            return false;
+        }
+        madvise(map, size_t(bytes), MADV_SEQUENTIAL);
+        // Records are written once and left to writeback, keep them out of
+        // an mlockall(MCL_FUTURE | MCL_ONFAULT) or every window gets pinned
+        munlock(map, size_t(bytes));
+        window_ = static_cast<uint8_t*>(map);
+        window_offset_ = base;
+        window_bytes_ = size_t(bytes);
+        return true;
+    }
+
+    bool fail(const char* what) {
+        int err = errno;
+        ::close(fd_);
+        fd_ = -1;
+        error_ = what;
+        errno = err;
+        return false;
+    }
+
+    int fd_ = -1;
+    uint64_t file_bytes_ = 0;
+    CaptureHeader* header_ = nullptr;   // the first page, mapped for the whole capture
+    uint8_t* window_ = nullptr;
+    uint64_t window_offset_ = 0;        // file offset of window_, page aligned
+    size_t window_bytes_ = 0;
+    uint64_t count_ = 0;
+    uint64_t synced_ = 0;
+    const char* error_ = "";
+};
+
+// Read-only view of a capture file. The records are read in place through
+// a window of CAPTURE_WINDOW_BYTES that follows the index, a reference
+// stays valid until a record outside the window is read.
+//
+//   CaptureReader capture;
+//   if (capture.open("run.tmag")) for (const CaptureRecord& r : capture) { ... }
+class CaptureReader {
+public:
+    class Iterator {
+    public:
+        Iterator(const CaptureReader* reader, uint64_t i) : reader_(reader), i_(i) {}
+
+        const CaptureRecord& operator*() const {
+            return (*reader_)[i_];
+        }
+
+        Iterator& operator++() {
+            i_++;
+            return *this;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return i_ != other.i_;
+        }
+
+    private:
+        const CaptureReader* reader_;
+        uint64_t i_;
+    };
+
+    CaptureReader() = default;
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    ~CaptureReader() {
+        close();
+    }
+
+    // A file cut short by a crash opens with the records that made it to disk
+    bool open(const char* path) {
+        close();
+        fd_ = ::open(path, O_RDONLY);
+        if (fd_ < 0) {
+            error_ = "can't open capture file";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) < 0 || uint64_t(st.st_size) < sizeof(CaptureHeader)) {
+            return fail("capture file too short");
+        }
+        void* map = mmap(nullptr, page_size(), PROT_READ, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            return fail("can't map capture file");
+        }
+        header_ = static_cast<const CaptureHeader*>(map);
+        if (memcmp(header_->magic_, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+            header_->version_ != CAPTURE_VERSION || header_->record_size_ != sizeof(CaptureRecord)) {
+            close();
+            error_ = "not a capture file";
+            return false;
+        }
+        file_bytes_ = uint64_t(st.st_size);
+        count_ = (file_bytes_ - sizeof(CaptureHeader)) / sizeof(CaptureRecord);
+        if (header_->count_ < count_) {
+            count_ = header_->count_;
+        }
+        return true;
+    }
+
+    void close() {
+        if (window_) {
+            munmap(const_cast<uint8_t*>(window_), window_bytes_);
+            window_ = nullptr;
+            window_offset_ = 0;
+            window_bytes_ = 0;
+        }
+        if (header_) {
+            munmap(const_cast<CaptureHeader*>(header_), page_size());
+            header_ = nullptr;
+            count_ = 0;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // All zero while no file is open
+    const CaptureHeader& header() const {
+        static const CaptureHeader none = CaptureHeader();
+        return header_ ? *header_ : none;
+    }
+
+    // Register snapshot from the header, 0 while no file is open or for an
+    // address past LAST_ADDRESS
+    TMAG5170Q1Protocol::Data registers(TMAG5170Q1Protocol::ADDRESS address) const {
+        TMAG5170Q1Protocol::Data data;
+        data.raw_ = header_ && unsigned(address) < TMAG5170Q1Protocol::LAST_ADDRESS ? header_->registers_[address] : 0;
+        return data;
+    }
+
+    bool is_open() const {
+        return header_ != nullptr;
+    }
+
+    uint64_t size() const {
+        return count_;
+    }
+
+    // i < size(). Moves the window when record i lies outside it, a record
+    // that can't be mapped reads as all zero with error() set.
+    const CaptureRecord& operator[](uint64_t i) const {
+        static const CaptureRecord missing = CaptureRecord();
+        uint64_t offset = sizeof(CaptureHeader) + i * sizeof(CaptureRecord);
+        if (offset < window_offset_ || offset + sizeof(CaptureRecord) > window_offset_ + window_bytes_) {
+            if (!slide(offset)) {
+                return missing;
+            }
+        }
+        return *reinterpret_cast<const CaptureRecord*>(window_ + (offset - window_offset_));
+    }
+
+    Iterator begin() const {
+        return Iterator(this, 0);
+    }
+
+    Iterator end() const {
+        return Iterator(this, count_);
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    bool slide(uint64_t offset) const {
+        if (window_) {
+            munmap(const_cast<uint8_t*>(window_), window_bytes_);
+            window_ = nullptr;
+            window_bytes_ = 0;
+        }
+        uint64_t base = offset / page_size() * page_size();
+        uint64_t bytes = file_bytes_ - base < CAPTURE_WINDOW_BYTES ? file_bytes_ - base : CAPTURE_WINDOW_BYTES;
+        void* map = mmap(nullptr, size_t(bytes), PROT_READ, MAP_SHARED, fd_, off_t(base));
+        if (map == MAP_FAILED) {
+            error_ = "can't map capture window";
+            return false;
+        }
+        madvise(map, size_t(bytes), MADV_SEQUENTIAL);
+        window_ = static_cast<const uint8_t*>(map);
+        window_offset_ = base;
+        window_bytes_ = size_t(bytes);
+        return true;
+    }
+
+    bool fail(const char* what) {
+        ::close(fd_);
+        fd_ = -1;
+        error_ = what;
+        return false;
+    }
+
+    int fd_ = -1;
+    uint64_t file_bytes_ = 0;
+    const CaptureHeader* header_ = nullptr;
+    uint64_t count_ = 0;
+    // The window moves on reads, also through const access
+    mutable const uint8_t* window_ = nullptr;
+    mutable uint64_t window_offset_ = 0;
+    mutable size_t window_bytes_ = 0;
+    mutable const char* error_ = "";
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_CAPTURE
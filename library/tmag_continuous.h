@@ -0,0 +1,121 @@
+#ifndef TMAG5170Q1_CONTINUOUS
+#define TMAG5170Q1_CONTINUOUS
+#include "tmag_sensor.h"
+#include "tmag_stream.h"
+
+namespace TMAG5170Q1 {
+
+// Triggered conversion at the highest rate the bus allows.
+//
+// The device runs in ACTIVE_TRIGGER_MODE with conversions started by the
+// cmd0 bit of a frame. Each cycle is one batch of four frames,
+// X, Y, Z, TEMP + START_AT_CS_LOW: the frames read the results of the
+// conversion started by the previous cycle and the last one starts the
+// next conversion. The answer to the TEMP read arrives as the first
+// response of the following cycle, so no extra flush frame is needed and a
+// sample costs four frames. Samples come out one cycle late.
+//
+// A cycle that comes around before the triggered conversion finished reads
+// the previous X/Y/Z again. The SET_COUNT in the first response of each
+// cycle tells them apart, such a sample has fresh_ false.
+//
+//   ContinuousAcquisition<TMAG5170Q1Device> acq(dev);
+//   acq.configure();
+//   acq.start();
+//   Sample s;
+//   while (...) if (acq.poll(s)) { ... }
+template <class Device>
+class ContinuousAcquisition {
+public:
+    typedef typename Device::Data Data;
+
+    explicit ContinuousAcquisition(Device& device) : device_(device) {
+        tx_.resize(FRAMES);
+        for (int i = 0; i < FRAMES; i++) {
+            tx_[i] = FrameCodec::encode_tx(registers()[i], Device::READ, 0,
+                i == FRAMES - 1 ? Device::START_AT_CS_LOW : Device::NO_CONVERSION);
+        }
+    }
+
+    // conv_avg is the CONV_AVG field of DEVICE_CONFIG, sensor_config
+    // selects ranges, MAG_CH_EN is forced to XYZ
+    void configure(unsigned int conv_avg = 0, Data sensor_config = Data()) {
+        Data device_config;
+        device_config.raw_ = 0;
+        device_config.device_config_.conv_avg_ = conv_avg;
+        device_config.device_config_.operating_mode_ = Device::ACTIVE_TRIGGER_MODE;
+        device_config.device_config_.t_ch_en_ = 1;
+
+        sensor_config.sensor_config_.mag_ch_en_ = Device::MAG_CH_XYZ;
+
+        Data system_config;
+        system_config.raw_ = 0;
+        system_config.system_config_.trigger_mode_ = Device::TRIGGER_AT_SPI_COMMAND;
+
+        device_.write_data(
+            { Device::SYSTEM_CONFIG, Device::SENSOR_CONFIG, Device::DEVICE_CONFIG },
+            { system_config, sensor_config, device_config });
+    }
+
+    // Starts the first conversion
+    void start() {
+        device_.transfer_word(FrameCodec::encode_tx(Device::CONV_STATUS, Device::READ, 0, Device::START_AT_CS_LOW));
+        primed_ = false;
+        last_set_count_ = -1;
+    }
+
+    // Runs one cycle, returns true when sample holds a complete result set
+    bool poll(Sample& sample) {
+        std::vector<uint32_t>& rx = device_.rx_batch_;
+        tx_batch_ = tx_;
+        device_.transfer_words(tx_batch_, rx);
+
+        bool complete = primed_;
+        if (complete) {
+            sample = partial_;
+            sample.temp_ = int16_t(FrameCodec::data(rx[0]));
+        }
+        partial_.timestamp_ns_ = now_ns();
+        partial_.x_ = int16_t(FrameCodec::data(rx[1]));
+        partial_.y_ = int16_t(FrameCodec::data(rx[2]));
+        partial_.z_ = int16_t(FrameCodec::data(rx[3]));
+        // SET_COUNT before the X/Y/Z reads, unchanged when the conversion
+        // triggered by the previous cycle has not completed
+        int set_count = int(FrameCodec::rx_stat012(rx[0]));
+        partial_.set_count_ = uint8_t(set_count);
+        partial_.fresh_ = set_count != last_set_count_;
+        last_set_count_ = set_count;
+        primed_ = true;
+        return complete;
+    }
+
+    // Stops triggering, the device goes back to configuration mode
+    void stop() {
+        Data device_config;
+        device_config.raw_ = 0;
+        device_config.device_config_.operating_mode_ = Device::CONFIGURATION_MODE;
+        device_.write_data(Device::DEVICE_CONFIG, device_config);
+        primed_ = false;
+        last_set_count_ = -1;
+    }
+
+private:
+    static const int FRAMES = 4;
+
+    static const typename Device::ADDRESS* registers() {
+        static const typename Device::ADDRESS addresses[FRAMES] = {
+            Device::X_CH_RESULT, Device::Y_CH_RESULT, Device::Z_CH_RESULT, Device::TEMP_RESULT };
+        return addresses;
+    }
+
+    Device& device_;
+    std::vector<uint32_t> tx_;
+    std::vector<uint32_t> tx_batch_;
+    Sample partial_ = Sample();
+    bool primed_ = false;
+    int last_set_count_ = -1;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_CONTINUOUS
@@ -0,0 +1,272 @@
+#ifndef TMAG5170Q1_CONVERT
+#define TMAG5170Q1_CONVERT
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include "tmag_sensor.h"
+
+#if !defined(TMAG5170Q1_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TMAG5170Q1_SSE2
+#elif !defined(TMAG5170Q1_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define TMAG5170Q1_NEON
+#endif
+
+namespace TMAG5170Q1 {
+
+// Conversion of raw result codes to physical units.
+// B = range * code / 2^15, T = 25 + (code - 17522) / 60
+
+ENUM VARIANT {
+    TMAG5170A1 = 0, // +-25/50/100 mT
+    TMAG5170A2 = 1  // +-75/150/300 mT
+};
+
+// Full scale in mT for a X/Y/Z_RANGE field of SENSOR_CONFIG
+inline float range_mT(unsigned int range, VARIANT variant = TMAG5170A1) {
+    static const float ranges[2][4] = {
+        {50.0f, 25.0f, 100.0f, 50.0f},
+        {150.0f, 75.0f, 300.0f, 150.0f} };
+    return ranges[variant & 0x1][range & 0x3];
+}
+
+// mT per LSB for each axis
+struct Scale {
+    float x_;
+    float y_;
+    float z_;
+};
+
+inline Scale scale_from(TMAG5170Q1Protocol::Data sensor_config, VARIANT variant = TMAG5170A1) {
+    Scale scale;
+    scale.x_ = range_mT(sensor_config.sensor_config_.x_range_, variant) / 32768.0f;
+    scale.y_ = range_mT(sensor_config.sensor_config_.y_range_, variant) / 32768.0f;
+    scale.z_ = range_mT(sensor_config.sensor_config_.z_range_, variant) / 32768.0f;
+    return scale;
+}
+
+static const float TEMP_T0_C = 25.0f;
+static const float TEMP_ADC_T0 = 17522.0f;
+static const float TEMP_ADC_RES = 60.0f;   // LSB per degree C
+
+inline void convert_field_scalar(const int16_t* raw, size_t n, float scale, float* mT) {
+    for (size_t i = 0; i < n; i++) {
+        mT[i] = raw[i] * scale;
+    }
+}
+
+inline void convert_temp_scalar(const int16_t* raw, size_t n, float* celsius) {
+    const float offset = TEMP_T0_C - TEMP_ADC_T0 / TEMP_ADC_RES;
+    for (size_t i = 0; i < n; i++) {
+        celsius[i] = uint16_t(raw[i]) * (1.0f / TEMP_ADC_RES) + offset;
+    }
+}
+
+// raw * scale, 8 codes per step on SSE2/NEON
+inline void convert_field(const int16_t* raw, size_t n, float scale, float* mT) {
+    size_t i = 0;
+#if defined(TMAG5170Q1_SSE2)
+    const __m128 k = _mm_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(mT + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+        _mm_storeu_ps(mT + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+    }
+#elif defined(TMAG5170Q1_NEON)
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(raw + i);
+        vst1q_f32(mT + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+        vst1q_f32(mT + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+    }
+#endif
+    convert_field_scalar(raw + i, n - i, scale, mT + i);
+}
+
+// TEMP_RESULT codes are unsigned
+inline void convert_temp(const int16_t* raw, size_t n, float* celsius) {
+    size_t i = 0;
+#if defined(TMAG5170Q1_SSE2) || defined(TMAG5170Q1_NEON)
+    const float offset = TEMP_T0_C - TEMP_ADC_T0 / TEMP_ADC_RES;
+#endif
+#if defined(TMAG5170Q1_SSE2)
+    const __m128 k = _mm_set1_ps(1.0f / TEMP_ADC_RES);
+    const __m128 o = _mm_set1_ps(offset);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+        __m128i lo = _mm_unpacklo_epi16(v, zero);
+        __m128i hi = _mm_unpackhi_epi16(v, zero);
+        _mm_storeu_ps(celsius + i, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), k), o));
+        _mm_storeu_ps(celsius + i + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), k), o));
+    }
+#elif defined(TMAG5170Q1_NEON)
+    const float32x4_t o = vdupq_n_f32(offset);
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vreinterpretq_u16_s16(vld1q_s16(raw + i));
+        float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+        float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+        vst1q_f32(celsius + i, vmlaq_n_f32(o, lo, 1.0f / TEMP_ADC_RES));
+        vst1q_f32(celsius + i + 4, vmlaq_n_f32(o, hi, 1.0f / TEMP_ADC_RES));
+    }
+#endif
+    convert_temp_scalar(raw + i, n - i, celsius + i);
+}
+
+// atan on [0, 1], max error about 1e-5 rad
+inline float atan_unit(float a) {
+    float s = a * a;
+    return ((((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s) * a) + a;
+}
+
+inline void angle_block_scalar(const int16_t* a, const int16_t* b, size_t n, float* degrees, float* magnitude) {
+    const float PI_F = 3.14159265f;
+    for (size_t i = 0; i < n; i++) {
+        float x = a[i];
+        float y = b[i];
+        float ax = x < 0 ? -x : x;
+        float ay = y < 0 ? -y : y;
+        float mx = ax > ay ? ax : ay;
+        float mn = ax > ay ? ay : ax;
+        float r = atan_unit(mx > 0 ? mn / mx : 0.0f);
+        r = ay > ax ? PI_F / 2 - r : r;
+        r = x < 0 ? PI_F - r : r;
+        r = y < 0 ? 2 * PI_F - r : r;
+        degrees[i] = r * (180.0f / PI_F);
+        if (magnitude) {
+            magnitude[i] = std::sqrt(x * x + y * y);
+        }
+    }
+}
+
+// Host side equivalent of the on-chip angle engine for blocks of raw codes:
+// degrees[i] = atan2(b, a) in [0, 360), magnitude[i] = hypot(a, b) in LSB.
+// a and b are the axis pair, e.g. X and Y. magnitude may be null.
+inline void angle_block(const int16_t* a, const int16_t* b, size_t n, float* degrees, float* magnitude) {
+    size_t i = 0;
+#if defined(TMAG5170Q1_SSE2)
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half_pi = _mm_set1_ps(3.14159265f / 2);
+    const __m128 pi = _mm_set1_ps(3.14159265f);
+    const __m128 two_pi = _mm_set1_ps(2 * 3.14159265f);
+    const __m128 to_deg = _mm_set1_ps(180.0f / 3.14159265f);
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + i));
+        __m128 x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(va, va), 16));
+        __m128 y = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(vb, vb), 16));
+        __m128 ax = _mm_andnot_ps(sign, x);
+        __m128 ay = _mm_andnot_ps(sign, y);
+        __m128 mx = _mm_max_ps(ax, ay);
+        __m128 mn = _mm_min_ps(ax, ay);
+        __m128 q = _mm_and_ps(_mm_div_ps(mn, mx), _mm_cmpgt_ps(mx, zero));
+        __m128 s = _mm_mul_ps(q, q);
+        __m128 r = _mm_set1_ps(-0.0464964749f);
+        r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.15931422f));
+        r = _mm_sub_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.327622764f));
+        r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(r, s), q), q);
+        __m128 m = _mm_cmpgt_ps(ay, ax);
+        r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(half_pi, r)), _mm_andnot_ps(m, r));
+        m = _mm_cmplt_ps(x, zero);
+        r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(pi, r)), _mm_andnot_ps(m, r));
+        m = _mm_cmplt_ps(y, zero);
+        r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(two_pi, r)), _mm_andnot_ps(m, r));
+        _mm_storeu_ps(degrees + i, _mm_mul_ps(r, to_deg));
+        if (magnitude) {
+            _mm_storeu_ps(magnitude + i, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y))));
+        }
+    }
+#elif defined(TMAG5170Q1_NEON) && defined(__aarch64__)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t half_pi = vdupq_n_f32(3.14159265f / 2);
+    const float32x4_t pi = vdupq_n_f32(3.14159265f);
+    const float32x4_t two_pi = vdupq_n_f32(2 * 3.14159265f);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vcvtq_f32_s32(vmovl_s16(vld1_s16(a + i)));
+        float32x4_t y = vcvtq_f32_s32(vmovl_s16(vld1_s16(b + i)));
+        float32x4_t ax = vabsq_f32(x);
+        float32x4_t ay = vabsq_f32(y);
+        float32x4_t mx = vmaxq_f32(ax, ay);
+        float32x4_t mn = vminq_f32(ax, ay);
+        float32x4_t q = vbslq_f32(vcgtq_f32(mx, zero), vdivq_f32(mn, mx), zero);
+        float32x4_t s = vmulq_f32(q, q);
+        float32x4_t r = vfmaq_f32(vdupq_n_f32(0.15931422f), vdupq_n_f32(-0.0464964749f), s);
+        r = vfmaq_f32(vdupq_n_f32(-0.327622764f), r, s);
+        r = vfmaq_f32(q, vmulq_f32(r, s), q);
+        r = vbslq_f32(vcgtq_f32(ay, ax), vsubq_f32(half_pi, r), r);
+        r = vbslq_f32(vcltq_f32(x, zero), vsubq_f32(pi, r), r);
+        r = vbslq_f32(vcltq_f32(y, zero), vsubq_f32(two_pi, r), r);
+        vst1q_f32(degrees + i, vmulq_n_f32(r, 180.0f / 3.14159265f));
+        if (magnitude) {
+            vst1q_f32(magnitude + i, vsqrtq_f32(vfmaq_f32(vmulq_f32(x, x), y, y)));
+        }
+    }
+#endif
+    angle_block_scalar(a + i, b + i, n - i, degrees + i, magnitude ? magnitude + i : nullptr);
+}
+
+// Four float lanes for kernels that don't map onto a plain block loop,
+// used as X/Y/Z plus a spare or as four consecutive samples
+#if defined(TMAG5170Q1_SSE2)
+typedef __m128 Lanes;
+inline Lanes lanes_set(float x, float y, float z) { return _mm_setr_ps(x, y, z, 0.0f); }
+inline Lanes lanes_dup(float v) { return _mm_set1_ps(v); }
+inline Lanes lanes_zero() { return _mm_setzero_ps(); }
+inline Lanes lanes_add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+inline Lanes lanes_sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+inline Lanes lanes_mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+inline void lanes_store(float out[4], Lanes v) { _mm_storeu_ps(out, v); }
+inline Lanes lanes_load_s16(const int16_t* p) {
+    __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+}
+inline Lanes lanes_load_u16(const int16_t* p) {
+    __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+#elif defined(TMAG5170Q1_NEON)
+typedef float32x4_t Lanes;
+inline Lanes lanes_set(float x, float y, float z) { float v[4] = { x, y, z, 0.0f }; return vld1q_f32(v); }
+inline Lanes lanes_dup(float v) { return vdupq_n_f32(v); }
+inline Lanes lanes_zero() { return vdupq_n_f32(0.0f); }
+inline Lanes lanes_add(Lanes a, Lanes b) { return vaddq_f32(a, b); }
+inline Lanes lanes_sub(Lanes a, Lanes b) { return vsubq_f32(a, b); }
+inline Lanes lanes_mul(Lanes a, Lanes b) { return vmulq_f32(a, b); }
+inline void lanes_store(float out[4], Lanes v) { vst1q_f32(out, v); }
+inline Lanes lanes_load_s16(const int16_t* p) { return vcvtq_f32_s32(vmovl_s16(vld1_s16(p))); }
+inline Lanes lanes_load_u16(const int16_t* p) {
+    return vcvtq_f32_u32(vmovl_u16(vreinterpret_u16_s16(vld1_s16(p))));
+}
+#else
+struct Lanes {
+    float v_[4];
+};
+inline Lanes lanes_set(float x, float y, float z) { Lanes r = {{ x, y, z, 0.0f }}; return r; }
+inline Lanes lanes_dup(float v) { Lanes r = {{ v, v, v, v }}; return r; }
+inline Lanes lanes_zero() { return lanes_dup(0.0f); }
+inline Lanes lanes_add(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v_[i] += b.v_[i]; return a; }
+inline Lanes lanes_sub(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v_[i] -= b.v_[i]; return a; }
+inline Lanes lanes_mul(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v_[i] *= b.v_[i]; return a; }
+inline void lanes_store(float out[4], Lanes v) { for (int i = 0; i < 4; i++) out[i] = v.v_[i]; }
+inline Lanes lanes_load_s16(const int16_t* p) { Lanes r = {{ float(p[0]), float(p[1]), float(p[2]), float(p[3]) }}; return r; }
+inline Lanes lanes_load_u16(const int16_t* p) {
+    Lanes r = {{ float(uint16_t(p[0])), float(uint16_t(p[1])), float(uint16_t(p[2])), float(uint16_t(p[3])) }};
+    return r;
+}
+#endif
+
+// Converts a block of n X/Y/Z/TEMP results, any of the pointer pairs may be null
+inline void convert_block(const int16_t* x, const int16_t* y, const int16_t* z, const int16_t* temp, size_t n,
+    const Scale& scale, float* x_mT, float* y_mT, float* z_mT, float* temp_C) {
+    if (x && x_mT) convert_field(x, n, scale.x_, x_mT);
+    if (y && y_mT) convert_field(y, n, scale.y_, y_mT);
+    if (z && z_mT) convert_field(z, n, scale.z_, z_mT);
+    if (temp && temp_C) convert_temp(temp, n, temp_C);
+}
+
+}
+
+#endif //#ifndef TMAG5170Q1_CONVERT
@@ -0,0 +1,299 @@
+#ifndef TMAG5170Q1_FILTER
+#define TMAG5170Q1_FILTER
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <type_traits>
+#include "tmag_convert.h"
+
+namespace TMAG5170Q1 {
+
+// Streaming decimation of X/Y/Z result blocks. All state lives in the
+// filter objects, process() can be fed blocks of any size and returns the
+// number of output samples written, at most n / ratio + 1.
+//
+//   CicDecimator<3, 16>          fixed point, no multiplies, gain removed
+//   FixedBiquadCascade<Sections> Q28 biquads for cores without an FPU
+//   BiquadCascadeXYZ<Sections>   float biquads, X/Y/Z in one SSE2/NEON vector
+//   XYZFilter<Filter>            one single channel filter per axis
+//
+// A typical chain is a CIC stage down to a few times the output rate and
+// a biquad lowpass for the final decimation.
+
+inline int16_t saturate16(int64_t v) {
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : int16_t(v);
+}
+
+constexpr unsigned int ceil_log2(uint64_t v) {
+    return v <= 1 ? 0 : 1 + ceil_log2((v + 1) / 2);
+}
+
+constexpr uint64_t power(uint64_t base, unsigned int exponent) {
+    return exponent == 0 ? 1 : base * power(base, exponent - 1);
+}
+
+// Cascaded integrator comb decimator, differential delay 1. The registers
+// wrap modulo 2^bits(Acc), which is exact as long as they hold the input
+// plus Stages * log2(Ratio) bits of growth. Output is scaled back to input
+// units and rounded.
+template <unsigned int Stages, unsigned int Ratio, class Acc = int32_t>
+class CicDecimator {
+public:
+    static const uint64_t GAIN = power(Ratio, Stages);
+    static_assert(Stages > 0 && Ratio > 1, "CIC needs at least one stage and a ratio");
+    static_assert(16 + Stages * ceil_log2(Ratio) <= 8 * sizeof(Acc), "CIC register growth does not fit Acc");
+
+    CicDecimator() {
+        reset();
+    }
+
+    void reset() {
+        for (unsigned int s = 0; s < Stages; s++) {
+            integrator_[s] = 0;
+            comb_[s] = 0;
+        }
+        phase_ = 0;
+    }
+
+    size_t process(const int16_t* in, size_t n, int16_t* out) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            Word v = Word(Acc(in[i]));
+            for (unsigned int s = 0; s < Stages; s++) {
+                integrator_[s] += v;
+                v = integrator_[s];
+            }
+            if (++phase_ == Ratio) {
+                phase_ = 0;
+                for (unsigned int s = 0; s < Stages; s++) {
+                    Word d = v - comb_[s];
+                    comb_[s] = v;
+                    v = d;
+                }
+                out[m++] = normalize(Acc(v));
+            }
+        }
+        return m;
+    }
+
+    static constexpr unsigned int ratio() {
+        return Ratio;
+    }
+
+private:
+    typedef typename std::make_unsigned<Acc>::type Word;
+
+    static int16_t normalize(int64_t v) {
+        if ((GAIN & (GAIN - 1)) == 0) {
+            const unsigned int shift = ceil_log2(GAIN);
+            return saturate16((v + int64_t(GAIN / 2)) >> shift);
+        }
+        return saturate16(v >= 0 ? (v + int64_t(GAIN / 2)) / int64_t(GAIN) : (v - int64_t(GAIN / 2)) / int64_t(GAIN));
+    }
+
+    Word integrator_[Stages];
+    Word comb_[Stages];
+    unsigned int phase_;
+};
+
+// Biquad coefficients normalized to a0 = 1:
+// y = b0 x + b1 x[-1] + b2 x[-2] - a1 y[-1] - a2 y[-2]
+struct Biquad {
+    float b0_, b1_, b2_, a1_, a2_;
+
+    // RBJ cookbook lowpass, q = 0.7071 is Butterworth
+    static Biquad lowpass(float sample_rate, float cutoff, float q = 0.70710678f) {
+        double w = 2.0 * M_PI * cutoff / sample_rate;
+        double alpha = std::sin(w) / (2.0 * q);
+        double c = std::cos(w);
+        double a0 = 1.0 + alpha;
+        Biquad f;
+        f.b0_ = float((1.0 - c) / 2.0 / a0);
+        f.b1_ = float((1.0 - c) / a0);
+        f.b2_ = f.b0_;
+        f.a1_ = float(-2.0 * c / a0);
+        f.a2_ = float((1.0 - alpha) / a0);
+        return f;
+    }
+
+    static Biquad passthrough() {
+        Biquad f = { 1.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        return f;
+    }
+};
+
+// Single channel biquad cascade in fixed point, direct form I with
+// first order error feedback so low cutoffs don't sit on truncation
+// limit cycles. Coefficients are Q4.28, low cutoffs need the fraction
+// bits (b0 is about 1e-3 at fc = fs / 100). Each term is one 32x32->64
+// multiply-accumulate (SMLAL on ARM), keeps every ratio-th output.
+template <unsigned int Sections>
+class FixedBiquadCascade {
+public:
+    static const int FRACTION_BITS = 28;
+
+    FixedBiquadCascade() {
+        for (unsigned int s = 0; s < Sections; s++) {
+            set_section(s, Biquad::passthrough());
+        }
+        reset();
+    }
+
+    void set_section(unsigned int s, const Biquad& f) {
+        Section& q = sections_[s];
+        q.b0_ = to_q(f.b0_);
+        q.b1_ = to_q(f.b1_);
+        q.b2_ = to_q(f.b2_);
+        q.a1_ = to_q(f.a1_);
+        q.a2_ = to_q(f.a2_);
+    }
+
+    // Keep one output in ratio, 1 filters without decimating
+    void set_ratio(unsigned int ratio) {
+        ratio_ = ratio ? ratio : 1;
+        phase_ = 0;
+    }
+
+    void reset() {
+        for (unsigned int s = 0; s < Sections; s++) {
+            Section& q = sections_[s];
+            q.x1_ = q.x2_ = q.y1_ = q.y2_ = 0;
+            q.error_ = 0;
+        }
+        phase_ = 0;
+    }
+
+    size_t process(const int16_t* in, size_t n, int16_t* out) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            int32_t v = in[i];
+            for (unsigned int s = 0; s < Sections; s++) {
+                Section& q = sections_[s];
+                int64_t acc = int64_t(q.b0_) * v + int64_t(q.b1_) * q.x1_ + int64_t(q.b2_) * q.x2_
+                            - int64_t(q.a1_) * q.y1_ - int64_t(q.a2_) * q.y2_ + q.error_;
+                int32_t y = int32_t(acc >> FRACTION_BITS);
+                q.error_ = acc - (int64_t(y) << FRACTION_BITS);
+                q.x2_ = q.x1_;
+                q.x1_ = v;
+                q.y2_ = q.y1_;
+                q.y1_ = y;
+                v = y;
+            }
+            if (++phase_ >= ratio_) {
+                phase_ = 0;
+                out[m++] = saturate16(v);
+            }
+        }
+        return m;
+    }
+
+private:
+    struct Section {
+        int32_t b0_, b1_, b2_, a1_, a2_;
+        int32_t x1_, x2_, y1_, y2_;
+        int64_t error_;
+    };
+
+    static int32_t to_q(float c) {
+        return int32_t(std::llround(double(c) * (1 << FRACTION_BITS)));
+    }
+
+    Section sections_[Sections];
+    unsigned int ratio_ = 1;
+    unsigned int phase_ = 0;
+};
+
+// Float biquad cascade over X/Y/Z together, transposed direct form II.
+// The recursion is serial in time, so the vector runs across the three
+// axes: one vector step filters one sample of each. Outputs are float in
+// input units, scale them with convert_field() or Scale.
+template <unsigned int Sections>
+class BiquadCascadeXYZ {
+public:
+    BiquadCascadeXYZ() {
+        for (unsigned int s = 0; s < Sections; s++) {
+            set_section(s, Biquad::passthrough());
+        }
+        reset();
+    }
+
+    void set_section(unsigned int s, const Biquad& f) {
+        Section& q = sections_[s];
+        q.b0_ = lanes_dup(f.b0_);
+        q.b1_ = lanes_dup(f.b1_);
+        q.b2_ = lanes_dup(f.b2_);
+        q.a1_ = lanes_dup(f.a1_);
+        q.a2_ = lanes_dup(f.a2_);
+    }
+
+    void set_ratio(unsigned int ratio) {
+        ratio_ = ratio ? ratio : 1;
+        phase_ = 0;
+    }
+
+    void reset() {
+        for (unsigned int s = 0; s < Sections; s++) {
+            sections_[s].s1_ = lanes_zero();
+            sections_[s].s2_ = lanes_zero();
+        }
+        phase_ = 0;
+    }
+
+    size_t process(const int16_t* x, const int16_t* y, const int16_t* z, size_t n,
+                   float* out_x, float* out_y, float* out_z) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            Lanes v = lanes_set(x[i], y[i], z[i]);
+            for (unsigned int s = 0; s < Sections; s++) {
+                Section& q = sections_[s];
+                Lanes r = lanes_add(lanes_mul(q.b0_, v), q.s1_);
+                q.s1_ = lanes_add(lanes_sub(lanes_mul(q.b1_, v), lanes_mul(q.a1_, r)), q.s2_);
+                q.s2_ = lanes_sub(lanes_mul(q.b2_, v), lanes_mul(q.a2_, r));
+                v = r;
+            }
+            if (++phase_ >= ratio_) {
+                phase_ = 0;
+                float lanes[4];
+                lanes_store(lanes, v);
+                out_x[m] = lanes[0];
+                out_y[m] = lanes[1];
+                out_z[m] = lanes[2];
+                m++;
+            }
+        }
+        return m;
+    }
+
+private:
+    struct Section {
+        Lanes b0_, b1_, b2_, a1_, a2_;
+        Lanes s1_, s2_;
+    };
+
+    Section sections_[Sections];
+    unsigned int ratio_ = 1;
+    unsigned int phase_ = 0;
+};
+
+// Runs one single channel int16 filter per axis, all three stay in step
+template <class Filter>
+struct XYZFilter {
+    Filter x_, y_, z_;
+
+    size_t process(const int16_t* x, const int16_t* y, const int16_t* z, size_t n,
+                   int16_t* out_x, int16_t* out_y, int16_t* out_z) {
+        y_.process(y, n, out_y);
+        z_.process(z, n, out_z);
+        return x_.process(x, n, out_x);
+    }
+
+    void reset() {
+        x_.reset();
+        y_.reset();
+        z_.reset();
+    }
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_FILTER
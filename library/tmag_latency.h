@@ -0,0 +1,244 @@
+#ifndef TMAG5170Q1_LATENCY
+#define TMAG5170Q1_LATENCY
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+#include "tmag_sensor.h"
+
+namespace TMAG5170Q1 {
+
+// Fixed memory log-linear histogram of nanosecond values. Values below 32
+// are exact, above that each power of two is split into 32 buckets, so a
+// bucket spans at most 1/32 of its value. Recording is an index
+// computation and one increment.
+class LatencyHistogram {
+public:
+    static const unsigned int SUB_BITS = 5;
+    static const unsigned int SUB_COUNT = 1 << SUB_BITS;
+    static const unsigned int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    LatencyHistogram() {
+        reset();
+    }
+
+    void record(uint64_t ns) {
+        counts_[index(ns)]++;
+        count_++;
+        sum_ += ns;
+        if (ns < min_) {
+            min_ = ns;
+        }
+        if (ns > max_) {
+            max_ = ns;
+        }
+    }
+
+    void reset() {
+        memset(counts_, 0, sizeof(counts_));
+        count_ = 0;
+        sum_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        if (other.min_ < min_) {
+            min_ = other.min_;
+        }
+        if (other.max_ > max_) {
+            max_ = other.max_;
+        }
+    }
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t min() const {
+        return count_ ? min_ : 0;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    double mean() const {
+        return count_ ? double(sum_) / count_ : 0.0;
+    }
+
+    // Upper end of the bucket holding the given fraction (0..1) of values
+    uint64_t percentile(double fraction) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t rank = uint64_t(fraction * count_ + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (unsigned int i = 0; i < BUCKETS; i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                uint64_t upper = highest(i);
+                return upper < max_ ? upper : max_;
+            }
+        }
+        return max_;
+    }
+
+    static unsigned int index(uint64_t ns) {
+        if (ns < SUB_COUNT) {
+            return unsigned(ns);
+        }
+        unsigned int exponent = 63 - __builtin_clzll(ns);
+        unsigned int sub = unsigned(ns >> (exponent - SUB_BITS)) & (SUB_COUNT - 1);
+        return (exponent - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    static uint64_t lowest(unsigned int index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        unsigned int exponent = index / SUB_COUNT + SUB_BITS - 1;
+        return uint64_t(SUB_COUNT + index % SUB_COUNT) << (exponent - SUB_BITS);
+    }
+
+    static uint64_t highest(unsigned int index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        unsigned int exponent = index / SUB_COUNT + SUB_BITS - 1;
+        return lowest(index) + (uint64_t(1) << (exponent - SUB_BITS)) - 1;
+    }
+
+    // count min mean p50 p99 p99.9 max on one line
+    void print(FILE* f, const char* name) const {
+        fprintf(f, "%-10s %12llu %8llu %10.1f %8llu %8llu %8llu %8llu\n", name,
+                (unsigned long long)count_, (unsigned long long)min(), mean(),
+                (unsigned long long)percentile(0.5), (unsigned long long)percentile(0.99),
+                (unsigned long long)percentile(0.999), (unsigned long long)max_);
+    }
+
+private:
+    uint64_t counts_[BUCKETS];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+// Trace policy timing each phase of every transfer with
+// CLOCK_MONOTONIC_RAW, which NTP never slews and which is a vDSO call on
+// the Pi. One histogram per TRACE_PHASE plus one for the whole transfer.
+// A batch from transfer_words() is timed as one transfer, histograms count
+// transfers while frames() counts frame words. Frames are passed on to
+// the Inner trace.
+//
+//   TMAG5170Q1DeviceT< SpidevTransport, LatencyTrace<> > dev(...);
+//   dev.trace_.set_report(stderr, 10000000000ull); // every 10 s
+//   ...
+//   dev.trace_.print(stdout);
+//
+// The histograms are plain memory owned by the thread using the device,
+// read them from that thread or after it stopped. A periodic report is
+// printed from the transfer path and starts a new interval.
+template <class Inner = NoTrace>
+class LatencyTrace {
+public:
+    void frame(uint32_t tx, uint32_t rx) {
+        frames_++;
+        inner_.frame(tx, rx);
+    }
+
+    void mark(TRACE_PHASE next) {
+        uint64_t now = clock_ns();
+        if (phase_ != PHASE_IDLE) {
+            phases_[phase_].record(now - since_);
+        } else {
+            start_ = now;
+        }
+        if (next == PHASE_IDLE) {
+            total_.record(now - start_);
+            if (report_ && now - report_since_ >= report_interval_ns_) {
+                print(report_);
+                reset();
+                report_since_ = now;
+            }
+        }
+        phase_ = next;
+        since_ = now;
+        inner_.mark(next);
+    }
+
+    // Prints and resets the histograms every interval_ns, nullptr disables
+    void set_report(FILE* f, uint64_t interval_ns) {
+        report_ = f;
+        report_interval_ns_ = interval_ns;
+        report_since_ = clock_ns();
+    }
+
+    const LatencyHistogram& histogram(TRACE_PHASE phase) const {
+        return phase == PHASE_IDLE ? total_ : phases_[phase];
+    }
+
+    // Whole transfers, from PHASE_ENCODE to PHASE_IDLE
+    const LatencyHistogram& total() const {
+        return total_;
+    }
+
+    uint64_t frames() const {
+        return frames_;
+    }
+
+    void reset() {
+        for (LatencyHistogram& h : phases_) {
+            h.reset();
+        }
+        total_.reset();
+        frames_ = 0;
+    }
+
+    void print(FILE* f) const {
+        fprintf(f, "%-10s %12s %8s %10s %8s %8s %8s %8s  ns, %llu frames\n", "phase",
+                "transfers", "min", "mean", "p50", "p99", "p99.9", "max", (unsigned long long)frames_);
+        phases_[PHASE_ENCODE].print(f, "encode");
+        phases_[PHASE_TRANSFER].print(f, "transfer");
+        phases_[PHASE_DECODE].print(f, "decode");
+        total_.print(f, "total");
+    }
+
+    Inner& inner() {
+        return inner_;
+    }
+
+    static uint64_t clock_ns() {
+        timespec t;
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &t);
+#endif
+        return uint64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+    }
+
+private:
+    LatencyHistogram phases_[PHASE_IDLE];
+    LatencyHistogram total_;
+    TRACE_PHASE phase_ = PHASE_IDLE;
+    uint64_t since_ = 0;
+    uint64_t start_ = 0;
+    uint64_t frames_ = 0;
+    FILE* report_ = nullptr;
+    uint64_t report_interval_ns_ = 0;
+    uint64_t report_since_ = 0;
+    Inner inner_;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_LATENCY
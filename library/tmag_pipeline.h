@@ -0,0 +1,264 @@
+#ifndef TMAG5170Q1_PIPELINE
+#define TMAG5170Q1_PIPELINE
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include "tmag_sensor.h"
+#include "tmag_ring.h"
+#include "tmag_thread.h"
+
+namespace TMAG5170Q1 {
+
+// What a producer does when the next queue is full
+ENUM OVERFLOW {
+    DROP_NEWEST = 0,    // count it in dropped and go on, for stages with a deadline
+    BLOCK = 1           // wait for room, the upstream queue takes the slack
+};
+
+struct PipelineConfig {
+    ThreadPlacement acquire_;
+    ThreadPlacement process_;
+    ThreadPlacement sink_;
+    OVERFLOW acquired_overflow_ = DROP_NEWEST;
+    OVERFLOW processed_overflow_ = BLOCK;
+    // Consumers spin this many empty polls before sleeping idle_sleep_
+    unsigned int idle_spins_ = 64;
+    std::chrono::microseconds idle_sleep_{50};
+};
+
+// Three threads connected by SPSC rings:
+//
+//   acquire  bool(Raw&)                      true when it produced an item
+//   process  bool(const Raw&, Processed&)    true when it produced an output
+//   sink     void(const Processed&)
+//
+// acquire is called in a loop and paces itself, typically by blocking on
+// the bus or on a deadline. By default it never waits for the process
+// stage, a full queue drops the newest item so acquisition keeps its
+// timing, while process waits for a slow sink. stop() ends acquisition
+// and lets the later stages drain what is queued.
+//
+//   Pipeline<Sample, Sample> pipeline;
+//   pipeline.start(config,
+//       [&](Sample& s) { return read_sample(dev, s, tracker); },
+//       [&](const Sample& in, Sample& out) { out = in; return true; },
+//       [&](const Sample& s) { capture.append(s); });
+template <class Raw, class Processed, size_t Depth = 1024>
+class Pipeline {
+public:
+    typedef std::function<bool(Raw&)> Acquire;
+    typedef std::function<bool(const Raw&, Processed&)> Process;
+    typedef std::function<void(const Processed&)> Sink;
+
+    struct Stats {
+        uint64_t acquired_;
+        uint64_t processed_;
+        uint64_t sunk_;
+        uint64_t acquired_dropped_;     // lost between acquire and process
+        uint64_t processed_dropped_;    // lost between process and sink
+        uint64_t acquired_blocked_;     // times acquire had to wait for room
+        uint64_t processed_blocked_;
+        size_t acquired_queued_;
+        size_t processed_queued_;
+    };
+
+    ~Pipeline() {
+        stop();
+    }
+
+    // Returns false with error() naming the step that failed when a
+    // thread could not be placed, nothing is left running then
+    bool start(const PipelineConfig& config, Acquire acquire, Process process, Sink sink) {
+        if (acquire_thread_.joinable()) {
+            error_ = "already running";
+            return false;
+        }
+        config_ = config;
+        acquire_ = std::move(acquire);
+        process_ = std::move(process);
+        sink_ = std::move(sink);
+        failed_.store(false, std::memory_order_relaxed);
+        ready_.store(0, std::memory_order_relaxed);
+        for (auto& flag : running_) {
+            flag.store(true, std::memory_order_relaxed);
+        }
+        sink_thread_ = std::thread([this] { run_sink(); });
+        process_thread_ = std::thread([this] { run_process(); });
+        acquire_thread_ = std::thread([this] { run_acquire(); });
+
+        // A stage that fails placement exits at once, wait until all are placed
+        while (ready_.load(std::memory_order_acquire) < 3 && !failed_.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        if (failed_.load(std::memory_order_acquire)) {
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    // Stops acquiring, drains the queues and joins all stages
+    void stop() {
+        running_[ACQUIRE].store(false, std::memory_order_relaxed);
+        if (acquire_thread_.joinable()) {
+            acquire_thread_.join();
+        }
+        running_[PROCESS].store(false, std::memory_order_release);
+        if (process_thread_.joinable()) {
+            process_thread_.join();
+        }
+        running_[SINK].store(false, std::memory_order_release);
+        if (sink_thread_.joinable()) {
+            sink_thread_.join();
+        }
+    }
+
+    // Counters are read while running, each is exact on its own
+    Stats stats() const {
+        Stats s;
+        s.acquired_ = acquired_.load(std::memory_order_relaxed);
+        s.processed_ = processed_.load(std::memory_order_relaxed);
+        s.sunk_ = sunk_.load(std::memory_order_relaxed);
+        s.acquired_dropped_ = acquired_ring_.dropped();
+        s.processed_dropped_ = processed_ring_.dropped();
+        s.acquired_blocked_ = acquired_blocked_.load(std::memory_order_relaxed);
+        s.processed_blocked_ = processed_blocked_.load(std::memory_order_relaxed);
+        s.acquired_queued_ = acquired_ring_.size();
+        s.processed_queued_ = processed_ring_.size();
+        return s;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    enum { ACQUIRE, PROCESS, SINK };
+
+    // A stage that fails placement never consumes, its producer must not wait for it
+    bool place(const ThreadPlacement& placement, int stage) {
+        const char* what = "";
+        if (place_thread(placement, &what) != 0) {
+            error_ = what;
+            running_[stage].store(false, std::memory_order_release);
+            failed_.store(true, std::memory_order_release);
+            return false;
+        }
+        ready_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    // Queues item according to policy, gives up only when consumer, the
+    // stage popping ring, has stopped. stop() lets a stage drain before
+    // stopping the next, so a blocking producer waits out a slow consumer.
+    template <class T, class Ring>
+    void forward(Ring& ring, const T& item, OVERFLOW policy, std::atomic<uint64_t>& blocked, int consumer) {
+        if (policy == DROP_NEWEST) {
+            ring.push(item);
+            return;
+        }
+        if (ring.try_push(item)) {
+            return;
+        }
+        blocked.fetch_add(1, std::memory_order_relaxed);
+        while (!ring.try_push(item)) {
+            if (!running_[consumer].load(std::memory_order_acquire)) {
+                ring.drop();
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Empty poll backoff for the consumers
+    void idle(unsigned int& spins) {
+        if (++spins < config_.idle_spins_) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(config_.idle_sleep_);
+        }
+    }
+
+    void run_acquire() {
+        if (!place(config_.acquire_, ACQUIRE)) {
+            return;
+        }
+        Raw item;
+        while (running_[ACQUIRE].load(std::memory_order_relaxed)) {
+            if (acquire_(item)) {
+                acquired_.fetch_add(1, std::memory_order_relaxed);
+                forward(acquired_ring_, item, config_.acquired_overflow_, acquired_blocked_, PROCESS);
+            }
+        }
+    }
+
+    void run_process() {
+        if (!place(config_.process_, PROCESS)) {
+            return;
+        }
+        Raw in;
+        Processed out;
+        unsigned int spins = 0;
+        for (;;) {
+            if (acquired_ring_.pop(in)) {
+                spins = 0;
+                if (process_(in, out)) {
+                    processed_.fetch_add(1, std::memory_order_relaxed);
+                    forward(processed_ring_, out, config_.processed_overflow_, processed_blocked_, SINK);
+                }
+            } else if (!running_[PROCESS].load(std::memory_order_acquire)) {
+                // acquire has been joined, so nothing more arrives
+                if (acquired_ring_.empty()) {
+                    return;
+                }
+            } else {
+                idle(spins);
+            }
+        }
+    }
+
+    void run_sink() {
+        if (!place(config_.sink_, SINK)) {
+            return;
+        }
+        Processed item;
+        unsigned int spins = 0;
+        for (;;) {
+            if (processed_ring_.pop(item)) {
+                spins = 0;
+                sink_(item);
+                sunk_.fetch_add(1, std::memory_order_relaxed);
+            } else if (!running_[SINK].load(std::memory_order_acquire)) {
+                if (processed_ring_.empty()) {
+                    return;
+                }
+            } else {
+                idle(spins);
+            }
+        }
+    }
+
+    PipelineConfig config_;
+    Acquire acquire_;
+    Process process_;
+    Sink sink_;
+    SPSCRing<Raw, Depth> acquired_ring_;
+    SPSCRing<Processed, Depth> processed_ring_;
+    std::atomic<bool> running_[3] = {};
+    std::atomic<bool> failed_{false};
+    std::atomic<int> ready_{0};
+    std::atomic<uint64_t> acquired_{0};
+    std::atomic<uint64_t> processed_{0};
+    std::atomic<uint64_t> sunk_{0};
+    std::atomic<uint64_t> acquired_blocked_{0};
+    std::atomic<uint64_t> processed_blocked_{0};
+    std::thread acquire_thread_;
+    std::thread process_thread_;
+    std::thread sink_thread_;
+    const char* error_ = "";
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_PIPELINE
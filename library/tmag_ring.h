@@ -0,0 +1,83 @@
+#ifndef TMAG5170Q1_RING
+#define TMAG5170Q1_RING
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace TMAG5170Q1 {
+
+// Lock-free single producer / single consumer ring buffer.
+// Capacity must be a power of two. push() never blocks, when the ring is
+// full the element is rejected and counted in dropped(). try_push() leaves
+// the counting to a producer that wants to retry.
+template <class T, size_t Capacity>
+class SPSCRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+    // Producer side
+    bool push(const T& value) {
+        if (!try_push(value)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    bool try_push(const T& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ == Capacity) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ == Capacity) {
+                return false;
+            }
+        }
+        slots_[head & (Capacity - 1)] = value;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Counts an element the producer gave up on
+    void drop() {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Consumer side
+    bool pop(T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail == head_cache_) {
+                return false;
+            }
+        }
+        value = slots_[tail & (Capacity - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const size_t CACHE_LINE = 64;
+
+    alignas(CACHE_LINE) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;     // producer's view of tail_
+    alignas(CACHE_LINE) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;     // consumer's view of head_
+    alignas(CACHE_LINE) std::atomic<uint64_t> dropped_{0};
+    T slots_[Capacity];
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_RING
@@ -1,24 +1,45 @@
 #ifndef TMAG5170Q1_INTERFACE
 #define TMAG5170Q1_INTERFACE
 #include <cstring>
-
-
-#define CRCPP_USE_NAMESPACE
-#define CRCPP_USE_CPP11
-#define CRCPP_INCLUDE_ESOTERIC_CRC_DEFINITIONS
-#include "CRC.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstddef>
+#include <vector>
 
 extern "C" void TMAG_TransferFrame(const uint8_t tx[4], uint8_t rx[4]);
+// Transfers count frames back to back in one transaction, CS is toggled between frames
+extern "C" void TMAG_TransferFrames(const uint8_t tx[][4], uint8_t rx[][4], size_t count);
 
 
 
 namespace TMAG5170Q1 {
-    
+
+// CRC-4/ITU (x^4 + x + 1, reflected) one nibble at a time.
+// entry_[r] is the register after clocking the 4 bits of r through it.
+struct CRC4Table {
+    uint8_t entry_[16];
+};
+
+constexpr CRC4Table make_crc4_table() {
+    CRC4Table table = {};
+    for (unsigned int i = 0; i < 16; i++) {
+        unsigned int r = i;
+        for (int bit = 0; bit < 4; bit++) {
+            r = (r & 0x1) ? ((r >> 1) ^ 0xC) : (r >> 1);
+        }
+        table.entry_[i] = static_cast<uint8_t>(r);
+    }
+    return table;
+}
+
+constexpr CRC4Table crc4_table = make_crc4_table();
+
 
 //#define ENUM enum class
 #define ENUM enum 
 
-class TMAG5170Q1Device {
+// Register map, frame layout and CRC of the TMAG5170-Q1 SPI protocol
+class TMAG5170Q1Protocol {
 public:
     typedef uint8_t CRC;
 
@@ -39,6 +60,40 @@ public:
         DATA_TYPE = 1
     };
 
+    ENUM OPERATING_MODE { // DEVICE_CONFIG
+        CONFIGURATION_MODE = 0,
+        STAND_BY_MODE = 1,
+        ACTIVE_MEASURE_MODE = 2, // continuous conversion
+        ACTIVE_TRIGGER_MODE = 3,
+        WAKE_UP_AND_SLEEP_MODE = 4,
+        SLEEP_MODE = 5,
+        DEEP_SLEEP_MODE = 6
+    };
+
+    ENUM TRIGGER_MODE { // SYSTEM_CONFIG
+        TRIGGER_AT_SPI_COMMAND = 0, // TXFrame cmd0
+        TRIGGER_AT_CS_PULSE = 1,
+        TRIGGER_AT_ALERT = 2
+    };
+
+    ENUM ANGLE_EN { // SENSOR_CONFIG
+        ANGLE_OFF = 0,
+        ANGLE_XY = 1,
+        ANGLE_YZ = 2,
+        ANGLE_XZ = 3
+    };
+
+    ENUM MAG_CH_EN { // SENSOR_CONFIG
+        MAG_CH_NONE = 0x0,
+        MAG_CH_X = 0x1,
+        MAG_CH_Y = 0x2,
+        MAG_CH_XY = 0x3,
+        MAG_CH_Z = 0x4,
+        MAG_CH_XZ = 0x5,
+        MAG_CH_YZ = 0x6,
+        MAG_CH_XYZ = 0x7
+    };
+
     ENUM ADDRESS {
         DEVICE_CONFIG = 0x0,  //  Configure Device Operation Modes Go
         SENSOR_CONFIG = 0x1, //   Configure Device Operation Modes Go
@@ -64,26 +119,103 @@ public:
     };
 
 
+    // Register fields are listed from bit 0 upwards
     union  __attribute__((packed))  Data {
-        struct {
+        uint16_t raw_;
 
+        struct __attribute__((packed))  {
+            unsigned int reserved0_:1;
+            unsigned int t_hlt_en_:1;
+            unsigned int t_rate_:1;
+            unsigned int t_ch_en_:1;
+            unsigned int operating_mode_:3;
+            unsigned int reserved7_:1;
+            unsigned int mag_tempco_:2;
+            unsigned int reserved10_:2;
+            unsigned int conv_avg_:3;
+            unsigned int reserved15_:1;
         } device_config_;
 
+        struct __attribute__((packed))  {
+            unsigned int x_range_:2;
+            unsigned int y_range_:2;
+            unsigned int z_range_:2;
+            unsigned int mag_ch_en_:4;
+            unsigned int sleeptime_:4;
+            unsigned int angle_en_:2;
+        } sensor_config_;
+
+        struct __attribute__((packed))  {
+            unsigned int x_hlt_en_:1;
+            unsigned int y_hlt_en_:1;
+            unsigned int z_hlt_en_:1;
+            unsigned int reserved3_:2;
+            unsigned int diag_en_:1;
+            unsigned int data_type_:3;
+            unsigned int trigger_mode_:2;
+            unsigned int reserved11_:1;
+            unsigned int diag_sel_:2;
+            unsigned int reserved14_:2;
+        } system_config_;
+
+        struct __attribute__((packed))  {
+            unsigned int x_thrx_alrt_:1;
+            unsigned int y_thrx_alrt_:1;
+            unsigned int z_thrx_alrt_:1;
+            unsigned int t_thrx_alrt_:1;
+            unsigned int thrx_count_:2;
+            unsigned int reserved6_:2;
+            unsigned int rslt_alrt_:1;
+            unsigned int reserved9_:2;
+            unsigned int status_alrt_:1;
+            unsigned int alert_mode_:1;
+            unsigned int alert_latch_:1;
+            unsigned int reserved14_:2;
+        } alert_config_;
+
+        struct __attribute__((packed))  {
+            unsigned int alrt_status_:2;
+            unsigned int reserved2_:2;
+            unsigned int set_count_:3;
+            unsigned int reserved7_:1;
+            unsigned int x_:1;
+            unsigned int y_:1;
+            unsigned int z_:1;
+            unsigned int t_:1;
+            unsigned int a_:1;
+            unsigned int rdy_:1;
+            unsigned int reserved14_:2;
+        } conv_status_;
+
+        struct __attribute__((packed))  {
+            unsigned int gain_value_:11;
+            unsigned int reserved11_:3;
+            unsigned int gain_selection_:2;
+        } mag_gain_config_;
+
         struct {
             int16_t value_ : 16;
         } result_;
         struct __attribute__((packed))  {
+            unsigned int fraction_:4;   // 1/16 degree
             unsigned int degrees_:12;
-            unsigned int fraction_:4;
-        } angle_;
+        } angle_; //ANGLE_RESULT
+
+        struct __attribute__((packed))  {
+            unsigned int value_:12;
+            unsigned int reserved12_:4;
+        } magnitude_; //MAGNITUDE_RESULT
 
         struct {
-            int8_t high_;
             int8_t low_;
+            int8_t high_;
         } threshold_; //X_THRX_CONFIG,Y_THRX_CONFIG,Z_THRX_CONFIG,T_THRX_CONFIG
 
     };
+    static_assert(sizeof(Data) == sizeof(uint16_t),"Boo!");
 
+    // Bitfield views of the frame words, they match FrameCodec on little
+    // endian GCC only. The driver itself uses FrameCodec.
     struct __attribute__((packed))  TXFrame {
         ADDRESS address_ : 7;
         RW rw_ : 1; //0:write 1:read
@@ -115,42 +247,208 @@ public:
 
 
 public:
-    TXFrame txbuf_;
-    RXFrame rxbuf_;
-    Data datamem[LAST_ADDRESS];
+    // frame holds the 4 frame bytes with msg[0] in bits 0..7. The CRC covers
+    // the first 24 bits, least significant nibble first, with the 0xF seed
+    // folded into the high nibble of msg[0].
+    static constexpr CRC calculate_crc(uint32_t frame) {
+        uint32_t bits = frame ^ 0xF0;
+        unsigned int crc = 0;
+        for (int nibble = 0; nibble < 6; nibble++) {
+            crc = crc4_table.entry_[(crc ^ bits) & 0xF];
+            bits >>= 4;
+        }
+        return static_cast<CRC>(crc);
+    }
 
-    CRC calculate_crc(uint8_t msg[4]) {
+    static constexpr uint32_t to_word(const uint8_t msg[4]) {
+        return uint32_t(msg[0]) | (uint32_t(msg[1]) << 8) | (uint32_t(msg[2]) << 16) | (uint32_t(msg[3]) << 24);
+    }
 
-        // Second argument is the number of bits. The input data must
-        // be a whole number of bytes. Pad any used bits with zeros.
+    static CRC calculate_crc(const uint8_t msg[4]) {
+        return calculate_crc(to_word(msg));
+    }
 
-        uint8_t message[4] = {msg[0],msg[1],msg[2],msg[3]};
-        message[0] ^= 0xF0;
-        std::uint32_t crc = CRCPP::CRC::CalculateBits(message, 24, CRCPP::CRC::CRC_4_ITU(),(unsigned char)0x00);
-        return crc;
-    
+    static unsigned int to_bits(CRC crc) {
+        unsigned int res = 0x0;
+        if (crc & 0x1) res += 0x1;
+        if (crc & 0x2) res += 0x10;
+        if (crc & 0x4) res += 0x100;
+        if (crc & 0x8) res += 0x1000;
+        return res;
     }
+};
 
+static_assert(TMAG5170Q1Protocol::calculate_crc(0x8a0000e0) == 0xa, "CRC of known good frame");
+static_assert(TMAG5170Q1Protocol::calculate_crc(0x8c000060) == 0xc, "CRC of known good frame");
 
 
-    void test_frame() {
-        memset(&txbuf_,0,sizeof(txbuf_));
-        memset(&rxbuf_,0,sizeof(rxbuf_));
-        uint8_t* p_tx = reinterpret_cast< uint8_t* >(&txbuf_);
+// Portable shift/mask codec for 32 bit frame words. A frame word holds the
+// 4 frame bytes with byte 0 in bits 0..7, whatever the host byte order.
+//
+//   tx: [6:0] address  [7] rw  [23:8] data  [27:24] crc  [28] cmd0 start conversion
+//       [29] cmd1 stat012 info  [31:30] reserved
+//   rx: [0] alert temp  [1] alert z  [2] alert y  [3] alert x  [4] alert 1  [5] alert 0
+//       [6] cfg reset  [7] prev crc status  [23:8] data  [27:24] crc  [30:28] stat012
+//       [31] error status
+struct FrameCodec {
+    typedef TMAG5170Q1Protocol P;
+
+    static const uint32_t CRC_MASK = 0x0F000000;
+
+    static constexpr uint32_t with_crc(uint32_t word) {
+        return (word & ~CRC_MASK) | (uint32_t(P::calculate_crc(word)) << 24);
+    }
+
+    static constexpr bool crc_ok(uint32_t word) {
+        return crc(word) == P::calculate_crc(word);
+    }
 
-        txbuf_.rw_ = RW::WRITE;
-        //transfer_frame();
-        txbuf_.rw_ = RW::READ;
+    static constexpr uint32_t encode_tx(unsigned int address, P::RW rw, uint16_t data,
+        P::START_CONVERSION cmd0 = P::NO_CONVERSION, P::STAT012_INFO cmd1 = P::SET_COUNT) {
+        return with_crc((address & 0x7F) | (uint32_t(rw & 0x1) << 7) | (uint32_t(data) << 8) |
+            (uint32_t(cmd0 & 0x1) << 28) | (uint32_t(cmd1 & 0x1) << 29));
+    }
+
+    // status holds rx bits 7..0, cfg_reset_ is bit 6 and prev_crc_status_ bit 7
+    static constexpr uint32_t encode_rx(uint8_t status, uint16_t data, unsigned int stat012, bool error_status) {
+        return with_crc(uint32_t(status) | (uint32_t(data) << 8) |
+            (uint32_t(stat012 & 0x7) << 28) | (uint32_t(error_status) << 31));
+    }
 
-        txbuf_.crc_ = calculate_crc(p_tx);
-        //p_tx[0] = 0x12;p_tx[1] = 0x34;p_tx[2] = 0x56;p_tx[3] = 0x78;
-        p_tx[0] = 0xe0; p_tx[1] = 0x00; p_tx[2] = 0x00; p_tx[3] = 0x8a; //Send frame with valid crc"
+    static constexpr uint16_t data(uint32_t word) { return uint16_t(word >> 8); }
+    static constexpr P::CRC crc(uint32_t word) { return P::CRC((word >> 24) & 0xF); }
+
+    static constexpr unsigned int tx_address(uint32_t word) { return word & 0x7F; }
+    static constexpr P::RW tx_rw(uint32_t word) { return P::RW((word >> 7) & 0x1); }
+    static constexpr P::START_CONVERSION tx_start_conversion(uint32_t word) { return P::START_CONVERSION((word >> 28) & 0x1); }
+    static constexpr P::STAT012_INFO tx_stat012_info(uint32_t word) { return P::STAT012_INFO((word >> 29) & 0x1); }
+
+    static constexpr uint8_t rx_status(uint32_t word) { return uint8_t(word); }
+    static constexpr bool rx_alert_temp(uint32_t word) { return word & 0x01; }
+    static constexpr bool rx_alert_z(uint32_t word) { return word & 0x02; }
+    static constexpr bool rx_alert_y(uint32_t word) { return word & 0x04; }
+    static constexpr bool rx_alert_x(uint32_t word) { return word & 0x08; }
+    static constexpr bool rx_alert_1(uint32_t word) { return word & 0x10; }
+    static constexpr bool rx_alert_0(uint32_t word) { return word & 0x20; }
+    static constexpr bool rx_cfg_reset(uint32_t word) { return word & 0x40; }
+    static constexpr bool rx_prev_crc_status(uint32_t word) { return word & 0x80; }
+    static constexpr unsigned int rx_stat012(uint32_t word) { return (word >> 28) & 0x7; }
+    static constexpr bool rx_error_status(uint32_t word) { return word >> 31; }
+
+    static void to_bytes(uint32_t word, uint8_t bytes[4]) {
+        bytes[0] = uint8_t(word);
+        bytes[1] = uint8_t(word >> 8);
+        bytes[2] = uint8_t(word >> 16);
+        bytes[3] = uint8_t(word >> 24);
+    }
+
+    // Converts between a frame word and its in-memory byte image in place,
+    // a no-op on little endian hosts
+    static constexpr uint32_t to_wire(uint32_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return __builtin_bswap32(word);
+#else
+        return word;
+#endif
+    }
+};
 
-        transfer_frame(false);
+static_assert(FrameCodec::encode_tx(TMAG5170Q1Protocol::X_THRX_CONFIG, TMAG5170Q1Protocol::WRITE, 0x1717) == 0x0a171704, "Known write frame");
+static_assert(FrameCodec::encode_tx(TMAG5170Q1Protocol::X_THRX_CONFIG, TMAG5170Q1Protocol::READ, 0) == 0x0a000084, "Known read frame");
+static_assert(FrameCodec::tx_address(0x0a171704) == TMAG5170Q1Protocol::X_THRX_CONFIG && FrameCodec::data(0x0a171704) == 0x1717, "Round trip");
+static_assert(FrameCodec::crc_ok(FrameCodec::encode_rx(0x40, 0x8001, 5, true)) && FrameCodec::rx_cfg_reset(0x40) && FrameCodec::rx_stat012(FrameCodec::encode_rx(0, 0, 5, 0)) == 5, "Round trip");
 
-        p_tx[0] = 0x60; p_tx[1] = 0x00; p_tx[2] = 0x00; p_tx[3] = 0x8c; //Send frame with valid crc"
-    
-        transfer_frame(false);
+
+// Parts of a transfer, see the Trace mark() hook
+ENUM TRACE_PHASE {
+    PHASE_ENCODE = 0,   // CRC and byte order of the tx words
+    PHASE_TRANSFER = 1, // transport call
+    PHASE_DECODE = 2,   // collecting the responses
+    PHASE_IDLE = 3      // outside the driver
+};
+
+// Trace policies, frame() is called once per transferred frame word and
+// mark() whenever a transfer enters the next phase, ending with PHASE_IDLE.
+// NoTrace compiles to nothing, see tmag_trace.h for a binary ring buffer
+// and tmag_latency.h for per-phase timing.
+struct NoTrace {
+    void frame(uint32_t, uint32_t) {}
+    void mark(TRACE_PHASE) {}
+};
+
+struct PrintfTrace {
+    void mark(TRACE_PHASE) {}
+
+    void frame(uint32_t tx, uint32_t rx) {
+        typedef TMAG5170Q1Protocol P;
+        printf("tx:%02x%02x%02x%02x val=%8d crc=%04x crc_calc=%04x -> ",
+            tx & 0xFF, (tx >> 8) & 0xFF, (tx >> 16) & 0xFF, tx >> 24,
+            (int)int16_t(FrameCodec::data(tx)),
+            P::to_bits(FrameCodec::crc(tx)),
+            P::to_bits(P::calculate_crc(tx)));
+
+        printf("rx:%02x%02x%02x%02x crc=%d reset=%d val=%8d err_stat=%d crc=%04x\n",
+            rx & 0xFF, (rx >> 8) & 0xFF, (rx >> 16) & 0xFF, rx >> 24,
+            FrameCodec::rx_prev_crc_status(rx),
+            FrameCodec::rx_cfg_reset(rx),
+            (int)int16_t(FrameCodec::data(rx)),
+            FrameCodec::rx_error_status(rx),
+            P::to_bits(FrameCodec::crc(rx)));
+    }
+};
+
+
+// Transports move frames to and from the device:
+//
+//   void transfer(const uint8_t tx[4], uint8_t rx[4]);
+//   void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count); // CS toggled between frames
+//
+// ExternTransport forwards to the TMAG_TransferFrame hooks. Others are
+// SpidevTransport (raspberry-pi/spi_bus.h), SimulatedTransport
+// (tmag_simulator.h) and RecordingTransport (tmag_transport.h).
+struct ExternTransport {
+    void transfer(const uint8_t tx[4], uint8_t rx[4]) {
+        TMAG_TransferFrame(tx, rx);
+    }
+    void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        TMAG_TransferFrames(tx, rx, count);
+    }
+};
+
+
+template <class Transport = ExternTransport, class Trace = NoTrace>
+class TMAG5170Q1DeviceT : public TMAG5170Q1Protocol {
+public:
+    explicit TMAG5170Q1DeviceT(Transport transport = Transport()) : transport_(transport) {}
+
+    Transport transport_;
+    Data datamem[LAST_ADDRESS];
+
+    // Last frame words exchanged, see FrameCodec
+    uint32_t tx_word_ = 0;
+    uint32_t rx_word_ = 0;
+
+    // The device answers a read in the following frame
+    bool pending_read_ = false;
+    ADDRESS pending_address_ = DEVICE_CONFIG;
+
+    // Sticky, set when any response reported cfg_reset_. Cleared by the user.
+    bool cfg_reset_seen_ = false;
+
+    // SET_COUNT of the last response whose frame asked for it, -1 before any
+    int set_count_ = -1;
+
+    Trace trace_;
+
+    // Frame words of the last batch, reused so steady state reads do not allocate
+    std::vector<uint32_t> tx_batch_;
+    std::vector<uint32_t> rx_batch_;
+
+
+
+    void test_frame() {
+        transfer_word(0x8a0000e0, false); //Send frame with valid crc"
+        transfer_word(0x8c000060, false); //Send frame with valid crc"
 
         Data data;
         data.threshold_.low_ = 23;
@@ -162,60 +460,125 @@ public:
     }
 
     void write_data(ADDRESS address, Data data) {
-        memset(&txbuf_,0,sizeof(txbuf_));
-        txbuf_.data_ = data;
-        txbuf_.rw_ = RW::WRITE;
-        txbuf_.address_ = address;
-        transfer_frame();
-        datamem[address] = rxbuf_.data_;
+        transfer_word(FrameCodec::encode_tx(address, RW::WRITE, data.raw_));
+        datamem[address] = data;
     }
 
+    // Writes data[i] to addresses[i], all sent in a single batched transfer
+    void write_data(const std::vector<ADDRESS>& addresses, const std::vector<Data>& data) {
+        std::vector<uint32_t>& tx = tx_batch_;
+        tx.resize(addresses.size());
+        for (size_t i = 0; i < tx.size(); i++) {
+            tx[i] = FrameCodec::encode_tx(addresses[i], RW::WRITE, data[i].raw_);
+        }
+        transfer_words(tx, rx_batch_);
+        for (size_t i = 0; i < tx.size(); i++) {
+            datamem[addresses[i]] = data[i];
+        }
+    }
 
+    // Reads one register, two frames since the data arrives in the next frame
     void read_data(ADDRESS address) {
-        memset(&txbuf_,0,sizeof(txbuf_));
-        txbuf_.rw_ = RW::READ;
-        txbuf_.address_ = address;
-        transfer_frame();
-        datamem[address] = rxbuf_.data_;
+        read_pipelined(address);
+        flush();
     }
 
-    unsigned int to_bits(CRC crc) {
-        unsigned int res = 0x0;
-        if (crc & 0x1) res += 0x1;
-        if (crc & 0x2) res += 0x10;
-        if (crc & 0x4) res += 0x100;
-        if (crc & 0x8) res += 0x1000;
-        return res;
+    // Requests address, the response lands in datamem[] with the next frame.
+    // The data received now belongs to the previously requested address.
+    void read_pipelined(ADDRESS address) {
+        transfer_word(FrameCodec::encode_tx(address, RW::READ, 0));
     }
-    void transfer_frame(bool updatecrc = true) {
-        uint8_t* p_tx = reinterpret_cast< uint8_t* >(&txbuf_);
-        if (updatecrc) {
-            txbuf_.crc_ = calculate_crc(p_tx);
+
+    // Clocks out one extra frame to collect the read still in flight
+    void flush() {
+        if (!pending_read_) {
+            return;
         }
+        read_pipelined(pending_address_);
+        pending_read_ = false;
+    }
 
-        uint8_t crc_calc = calculate_crc(p_tx);
+    // Reads all addresses in a single batched transfer of N+1 frames
+    void read_data(const std::vector<ADDRESS>& addresses) {
+        if (addresses.empty()) {
+            return;
+        }
+        std::vector<uint32_t>& tx = tx_batch_;
+        tx.resize(addresses.size() + 1);
+        for (size_t i = 0; i < tx.size(); i++) {
+            tx[i] = FrameCodec::encode_tx(addresses[i < addresses.size() ? i : i - 1], RW::READ, 0);
+        }
+        transfer_words(tx, rx_batch_);
+        pending_read_ = false;
+    }
 
-        uint8_t* p_rx = reinterpret_cast<uint8_t* >(&rxbuf_);
-        TMAG_TransferFrame(p_tx,p_rx);
-        printf("tx:%02x%02x%02x%02x val=%8d crc=%04x crc_calc=%04x -> ",
-            p_tx[0],p_tx[1],p_tx[2],p_tx[3],
-            (int)txbuf_.data_.result_.value_,
-            to_bits(txbuf_.crc_),
-            to_bits(crc_calc));
+    // Pairs rx with the read issued in the previous frame
+    void collect(uint32_t tx, uint32_t rx) {
+        if (FrameCodec::rx_cfg_reset(rx)) {
+            cfg_reset_seen_ = true;
+        }
+        if (FrameCodec::tx_stat012_info(tx) == SET_COUNT) {
+            set_count_ = int(FrameCodec::rx_stat012(rx));
+        }
+        if (pending_read_) {
+            datamem[pending_address_].raw_ = FrameCodec::data(rx);
+        }
+        unsigned int address = FrameCodec::tx_address(tx);
+        pending_read_ = (FrameCodec::tx_rw(tx) == RW::READ) && address < LAST_ADDRESS;
+        pending_address_ = ADDRESS(address);
+    }
 
-        printf("rx:%02x%02x%02x%02x crc=%d reset=%d val=%8d err_stat=%d crc=%04x\n",
-            p_rx[0],p_rx[1],p_rx[2],p_rx[3],
-            rxbuf_.prev_crc_status_, 
-            rxbuf_.cfg_reset_,
-            rxbuf_.data_.result_.value_,
-            rxbuf_.error_status_,
-            to_bits(rxbuf_.crc_));
+    // Exchanges one frame word, returns the response word
+    uint32_t transfer_word(uint32_t tx, bool updatecrc = true) {
+        trace_.mark(PHASE_ENCODE);
+        if (updatecrc) {
+            tx = FrameCodec::with_crc(tx);
+        }
+        uint8_t p_tx[4];
+        uint8_t p_rx[4];
+        FrameCodec::to_bytes(tx, p_tx);
+        trace_.mark(PHASE_TRANSFER);
+        transport_.transfer(p_tx,p_rx);
+        trace_.mark(PHASE_DECODE);
+        uint32_t rx = to_word(p_rx);
+
+        collect(tx, rx);
+        trace_.frame(tx, rx);
+        tx_word_ = tx;
+        rx_word_ = rx;
+        trace_.mark(PHASE_IDLE);
+        return rx;
     }
 
+    // Sets the CRC of every tx word and exchanges them all in one transport call
+    void transfer_words(std::vector<uint32_t>& tx, std::vector<uint32_t>& rx) {
+        rx.resize(tx.size());
+        if (tx.empty()) {
+            return;
+        }
+        trace_.mark(PHASE_ENCODE);
+        for (uint32_t& word : tx) {
+            word = FrameCodec::to_wire(FrameCodec::with_crc(word));
+        }
 
+        trace_.mark(PHASE_TRANSFER);
+        transport_.transfer(reinterpret_cast<const uint8_t(*)[4]>(tx.data()),
+            reinterpret_cast<uint8_t(*)[4]>(rx.data()), tx.size());
+        trace_.mark(PHASE_DECODE);
+        for (size_t i = 0; i < tx.size(); i++) {
+            tx[i] = FrameCodec::to_wire(tx[i]);
+            rx[i] = FrameCodec::to_wire(rx[i]);
+            collect(tx[i], rx[i]);
+            trace_.frame(tx[i], rx[i]);
+        }
+        tx_word_ = tx.back();
+        rx_word_ = rx.back();
+        trace_.mark(PHASE_IDLE);
+    }
 
 };
 
+typedef TMAG5170Q1DeviceT<> TMAG5170Q1Device;
 
 }
 
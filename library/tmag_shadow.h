@@ -0,0 +1,118 @@
+#ifndef TMAG5170Q1_SHADOW
+#define TMAG5170Q1_SHADOW
+#include "tmag_sensor.h"
+
+namespace TMAG5170Q1 {
+
+// Host side copy of the configuration registers DEVICE_CONFIG..MAG_GAIN_CONFIG.
+// Changes are made on the shadow and flush() writes only the registers that
+// differ from what the device holds, in one batched transfer.
+// When a response reports cfg_reset_ the device is back at its defaults and
+// every configured register is written again.
+//
+//   RegisterShadow<TMAG5170Q1Device> shadow(dev);
+//   shadow.edit(TMAG5170Q1Device::SENSOR_CONFIG).sensor_config_.x_range_ = 2;
+//   shadow.flush();
+template <class Device>
+class RegisterShadow {
+public:
+    typedef typename Device::ADDRESS ADDRESS;
+    typedef typename Device::Data Data;
+
+    explicit RegisterShadow(Device& device) : device_(device) {
+        memset(wanted_, 0, sizeof(wanted_));
+        memset(written_, 0, sizeof(written_));
+        memset(configured_, 0, sizeof(configured_));
+        memset(synced_, 0, sizeof(synced_));
+    }
+
+    static bool is_config(ADDRESS address) {
+        return address <= Device::T_THRX_CONFIG || address == Device::TEST_CONFIG || address == Device::MAG_GAIN_CONFIG;
+    }
+
+    void set(ADDRESS address, Data data) {
+        edit(address) = data;
+    }
+
+    // Typed access, the register takes part in flush() from now on
+    Data& edit(ADDRESS address) {
+        configured_[address] = true;
+        return wanted_[address];
+    }
+
+    const Data& get(ADDRESS address) const {
+        return wanted_[address];
+    }
+
+    bool dirty(ADDRESS address) const {
+        return configured_[address] && (!synced_[address] || wanted_[address].raw_ != written_[address].raw_);
+    }
+
+    // Forget what the device holds, the next flush() writes every configured register
+    void invalidate() {
+        memset(synced_, 0, sizeof(synced_));
+    }
+
+    // Returns the number of registers written
+    size_t flush() {
+        size_t count = 0;
+        if (device_.cfg_reset_seen_) {
+            invalidate();
+        }
+        // A reset reported inside the batch leaves the registers that were
+        // not (or no longer) written at their defaults, so go round once more.
+        for (int pass = 0; pass < 2; pass++) {
+            device_.cfg_reset_seen_ = false;
+            addresses_.clear();
+            data_.clear();
+            for (int a = 0; a < Device::LAST_ADDRESS; a++) {
+                ADDRESS address = ADDRESS(a);
+                if (is_config(address) && dirty(address)) {
+                    addresses_.push_back(address);
+                    data_.push_back(wanted_[address]);
+                }
+            }
+            if (addresses_.empty()) {
+                break;
+            }
+            device_.write_data(addresses_, data_);
+            count += addresses_.size();
+
+            // The first response shows the state before the batch, a reset
+            // seen there happened before any of the writes.
+            size_t reset_at = addresses_.size();
+            for (size_t i = 0; i < device_.rx_batch_.size(); i++) {
+                if (FrameCodec::rx_cfg_reset(device_.rx_batch_[i])) {
+                    reset_at = i;
+                    break;
+                }
+            }
+            if (reset_at < addresses_.size()) {
+                invalidate();
+            }
+            if (reset_at == 0 || reset_at == addresses_.size()) {
+                for (ADDRESS address : addresses_) {
+                    written_[address] = wanted_[address];
+                    synced_[address] = true;
+                }
+            }
+            if (reset_at == addresses_.size()) {
+                break;
+            }
+        }
+        return count;
+    }
+
+private:
+    Device& device_;
+    Data wanted_[Device::LAST_ADDRESS];
+    Data written_[Device::LAST_ADDRESS];
+    bool configured_[Device::LAST_ADDRESS];
+    bool synced_[Device::LAST_ADDRESS];
+    std::vector<ADDRESS> addresses_;
+    std::vector<Data> data_;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_SHADOW
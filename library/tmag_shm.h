@@ -0,0 +1,479 @@
+#ifndef TMAG5170Q1_SHM
+#define TMAG5170Q1_SHM
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tmag_sensor.h"
+#include "tmag_stream.h"
+#include "tmag_capture.h"
+
+namespace TMAG5170Q1 {
+
+// Sample bus in POSIX shared memory: one process owns the sensor and
+// publishes, any number of processes subscribe without talking to it.
+//
+//   ShmHeader  registers at start, publisher pid, head_ = samples published
+//   ShmSlot    [capacity_], sample n lives in slot n % capacity_
+//
+// Each slot is a seqlock: seq_ is 2n + 1 while sample n is written and
+// 2n + 2 once it is complete. A subscriber reads the record in place and
+// checks seq_ again, a changed seq_ means the publisher lapped it and the
+// sample is counted as lost. The publisher never waits for subscribers
+// and subscribers never write to the slots, a slow or dead reader costs
+// the others nothing. Subscribers can sleep on a futex in the header,
+// the publisher only makes the wake syscall while someone sleeps.
+
+static const char SHM_MAGIC[8] = { 'T', 'M', 'A', 'G', 'S', 'H', 'M', '1' };
+static const uint32_t SHM_VERSION = 1;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory seqlock needs lock-free 64 bit atomics");
+
+struct ShmHeader {
+    char magic_[8];
+    std::atomic<uint32_t> version_;     // stored last, 0 while the publisher sets up
+    uint32_t record_size_;
+    uint64_t start_ns_;                 // steady clock when the bus was created
+    uint64_t capacity_;                 // slots, a power of two
+    int32_t publisher_pid_;
+    uint32_t reserved0_;
+    uint16_t registers_[TMAG5170Q1Protocol::LAST_ADDRESS];
+    uint8_t reserved1_[128 - 40 - 2 * TMAG5170Q1Protocol::LAST_ADDRESS];
+
+    // Written per sample, on their own cache line
+    alignas(64) std::atomic<uint64_t> head_;
+    std::atomic<uint32_t> wake_;        // futex word, bumped per sample
+    std::atomic<uint32_t> waiters_;     // subscribers sleeping on wake_
+    std::atomic<uint32_t> closed_;
+    uint8_t reserved2_[64 - 20];
+};
+static_assert(sizeof(ShmHeader) == 192, "Shared memory header layout");
+
+// The record is a CaptureRecord held in words so readers racing the
+// publisher stay within the memory model
+struct ShmSlot {
+    static const size_t WORDS = sizeof(CaptureRecord) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> seq_;
+    std::atomic<uint64_t> words_[WORDS];
+};
+static_assert(sizeof(ShmSlot) == 32, "Shared memory slot layout");
+
+inline long shm_futex(std::atomic<uint32_t>* word, int op, uint32_t value, const timespec* timeout = nullptr) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, nullptr, 0);
+}
+
+// Owns the bus name, creates it on open() and removes it on close().
+// Subscribers that still have it mapped keep reading what is there.
+//
+//   ShmPublisher bus;
+//   if (!bus.open("/tmag5170", 4096, dev.datamem)) perror(bus.error());
+//   bus.publish(sample);
+class ShmPublisher {
+public:
+    ShmPublisher() = default;
+    ShmPublisher(const ShmPublisher&) = delete;
+    ShmPublisher& operator=(const ShmPublisher&) = delete;
+
+    ~ShmPublisher() {
+        close();
+    }
+
+    // name is a shm_open() name ("/tmag5170"), a stale bus left by a crashed
+    // publisher is replaced. Fails with EBUSY while the publisher of an
+    // existing bus is still running. capacity is rounded up to a power of two,
+    // registers as for CaptureWriter::open(). Returns false with errno set
+    // and error() naming the step that failed.
+    bool open(const char* name, uint64_t capacity, const TMAG5170Q1Protocol::Data* registers = nullptr,
+              mode_t mode = 0660) {
+        close();
+        uint64_t slots = 2;
+        while (slots < capacity) {
+            slots <<= 1;
+        }
+        if (published_elsewhere(name)) {
+            error_ = "shared memory is in use by a running publisher";
+            errno = EBUSY;
+            return false;
+        }
+        shm_unlink(name);
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, mode);
+        if (fd < 0) {
+            error_ = "can't create shared memory";
+            return false;
+        }
+        size_t bytes = sizeof(ShmHeader) + slots * sizeof(ShmSlot);
+        if (ftruncate(fd, bytes) < 0) {
+            return fail(fd, name, "can't size shared memory");
+        }
+        void* map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            return fail(fd, name, "can't map shared memory");
+        }
+        ::close(fd);
+        bytes_ = bytes;
+        header_ = static_cast<ShmHeader*>(map);
+        slots_ = reinterpret_cast<ShmSlot*>(header_ + 1);
+        mask_ = slots - 1;
+        snprintf(name_, sizeof(name_), "%s", name);
+
+        // The new object is zero filled, every seq_ is 0 so no slot passes
+        // for a published sample
+        memcpy(header_->magic_, SHM_MAGIC, sizeof(SHM_MAGIC));
+        header_->record_size_ = sizeof(CaptureRecord);
+        header_->start_ns_ = now_ns();
+        header_->capacity_ = slots;
+        header_->publisher_pid_ = getpid();
+        for (int i = 0; i < TMAG5170Q1Protocol::LAST_ADDRESS; i++) {
+            header_->registers_[i] = registers ? registers[i].raw_ : 0;
+        }
+        head_ = 0;
+        header_->version_.store(SHM_VERSION, std::memory_order_release);
+        return true;
+    }
+
+    void publish(const Sample& sample) {
+        CaptureRecord r;
+        r.timestamp_ns_ = sample.timestamp_ns_;
+        r.x_ = sample.x_;
+        r.y_ = sample.y_;
+        r.z_ = sample.z_;
+        r.temp_ = sample.temp_;
+        r.set_count_ = sample.set_count_;
+        r.flags_ = sample.fresh_ ? CaptureRecord::FRESH : 0;
+        memset(r.reserved_, 0, sizeof(r.reserved_));
+        uint64_t words[ShmSlot::WORDS];
+        memcpy(words, &r, sizeof(words));
+
+        ShmSlot& slot = slots_[head_ & mask_];
+        slot.seq_.store(2 * head_ + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < ShmSlot::WORDS; i++) {
+            slot.words_[i].store(words[i], std::memory_order_relaxed);
+        }
+        slot.seq_.store(2 * head_ + 2, std::memory_order_release);
+        header_->head_.store(++head_, std::memory_order_release);
+
+        // Pairs with the waiters_ increment in ShmSubscriber::wait()
+        header_->wake_.fetch_add(1, std::memory_order_seq_cst);
+        if (header_->waiters_.load(std::memory_order_seq_cst) != 0) {
+            shm_futex(&header_->wake_, FUTEX_WAKE, INT_MAX);
+        }
+    }
+
+    // Marks the bus closed, wakes subscribers and removes the name
+    void close() {
+        if (header_) {
+            header_->closed_.store(1, std::memory_order_release);
+            header_->wake_.fetch_add(1, std::memory_order_seq_cst);
+            shm_futex(&header_->wake_, FUTEX_WAKE, INT_MAX);
+            munmap(header_, bytes_);
+            shm_unlink(name_);
+            header_ = nullptr;
+            slots_ = nullptr;
+        }
+    }
+
+    uint64_t published() const {
+        return head_;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    // True when name is a bus that is not closed and whose publisher pid
+    // still exists. Anything unreadable counts as stale.
+    static bool published_elsewhere(const char* name) {
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ShmHeader)) {
+            map = mmap(nullptr, sizeof(ShmHeader), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        const ShmHeader* header = static_cast<const ShmHeader*>(map);
+        pid_t pid = header->publisher_pid_;
+        bool live = memcmp(header->magic_, SHM_MAGIC, sizeof(SHM_MAGIC)) == 0 && pid > 0 &&
+                    header->closed_.load(std::memory_order_acquire) == 0 &&
+                    (kill(pid, 0) == 0 || errno == EPERM);
+        munmap(map, sizeof(ShmHeader));
+        return live;
+    }
+
+    bool fail(int fd, const char* name, const char* what) {
+        int err = errno;
+        ::close(fd);
+        shm_unlink(name);
+        error_ = what;
+        errno = err;
+        return false;
+    }
+
+    size_t bytes_ = 0;
+    ShmHeader* header_ = nullptr;
+    ShmSlot* slots_ = nullptr;
+    uint64_t mask_ = 0;
+    uint64_t head_ = 0;
+    char name_[NAME_MAX] = "";
+    const char* error_ = "";
+};
+
+// Reads a bus from another process. A subscriber starts at the newest
+// sample and follows the publisher, read() returns what arrived since the
+// last call in order and counts samples overwritten before it got to them.
+//
+//   ShmSubscriber bus;
+//   if (!bus.open("/tmag5170")) perror(bus.error());
+//   Sample s[64];
+//   while (bus.wait(-1) > 0) {
+//       size_t n = bus.read(s, 64);
+//       ...
+//   }
+class ShmSubscriber {
+public:
+    ShmSubscriber() = default;
+    ShmSubscriber(const ShmSubscriber&) = delete;
+    ShmSubscriber& operator=(const ShmSubscriber&) = delete;
+
+    ~ShmSubscriber() {
+        close();
+    }
+
+    // Returns false with errno set and error() naming the step that failed,
+    // EAGAIN while the publisher is still setting the bus up
+    bool open(const char* name) {
+        close();
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            error_ = "can't open shared memory";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            return fail(fd, "can't stat shared memory");
+        }
+        if (size_t(st.st_size) < sizeof(ShmHeader)) {
+            errno = EAGAIN;
+            return fail(fd, "shared memory not set up yet");
+        }
+        // Mapped writable for the futex and waiters_, slots are only read
+        void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            return fail(fd, "can't map shared memory");
+        }
+        ::close(fd);
+        bytes_ = st.st_size;
+        header_ = static_cast<const ShmHeader*>(map);
+        wake_ = &static_cast<ShmHeader*>(map)->wake_;
+        waiters_ = &static_cast<ShmHeader*>(map)->waiters_;
+
+        uint32_t version = header_->version_.load(std::memory_order_acquire);
+        if (version == 0) {
+            errno = EAGAIN;
+            return unmap("shared memory not set up yet");
+        }
+        if (memcmp(header_->magic_, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 || version != SHM_VERSION ||
+            header_->record_size_ != sizeof(CaptureRecord) ||
+            bytes_ < sizeof(ShmHeader) + header_->capacity_ * sizeof(ShmSlot)) {
+            errno = EINVAL;
+            return unmap("not a sample bus");
+        }
+        slots_ = reinterpret_cast<const ShmSlot*>(header_ + 1);
+        mask_ = header_->capacity_ - 1;
+        seek_latest();
+        return true;
+    }
+
+    void close() {
+        if (header_) {
+            munmap(const_cast<ShmHeader*>(header_), bytes_);
+            header_ = nullptr;
+            slots_ = nullptr;
+        }
+    }
+
+    // Copies up to max samples in publishing order, returns how many
+    size_t read(Sample* out, size_t max) {
+        uint64_t head = header_->head_.load(std::memory_order_acquire);
+        if (head - cursor_ > header_->capacity_) {
+            lost_ += head - header_->capacity_ - cursor_;
+            cursor_ = head - header_->capacity_;
+        }
+        size_t m = 0;
+        while (m < max && cursor_ < head) {
+            if (load(cursor_, out[m])) {
+                m++;
+            } else {
+                lost_++;
+            }
+            cursor_++;
+        }
+        return m;
+    }
+
+    // Newest sample without moving the read position, false if none yet
+    bool latest(Sample& sample) const {
+        for (;;) {
+            uint64_t head = header_->head_.load(std::memory_order_acquire);
+            if (head == 0) {
+                return false;
+            }
+            if (load(head - 1, sample)) {
+                return true;
+            }
+        }
+    }
+
+    // Sleeps up to timeout_ms (-1 forever) until read() has something.
+    // Returns 1 when it has, 0 on timeout, -1 when the publisher closed the
+    // bus and everything is read. Signals and spurious wakeups go back to
+    // sleep for what is left of timeout_ms only.
+    int wait(int timeout_ms) {
+        uint64_t deadline = timeout_ms >= 0 ? now_ns() + uint64_t(timeout_ms) * 1000000 : 0;
+        timespec timeout;
+        timespec* t = nullptr;
+        for (;;) {
+            uint32_t wake = wake_->load(std::memory_order_seq_cst);
+            if (available()) {
+                return 1;
+            }
+            if (closed()) {
+                return -1;
+            }
+            if (timeout_ms >= 0) {
+                uint64_t now = now_ns();
+                if (now >= deadline) {
+                    return 0;
+                }
+                timeout.tv_sec = time_t((deadline - now) / 1000000000);
+                timeout.tv_nsec = long((deadline - now) % 1000000000);
+                t = &timeout;
+            }
+            waiters_->fetch_add(1, std::memory_order_seq_cst);
+            long ret = shm_futex(wake_, FUTEX_WAIT, wake, t);
+            int err = errno;
+            waiters_->fetch_sub(1, std::memory_order_seq_cst);
+            if (ret < 0 && err == ETIMEDOUT) {
+                return available() ? 1 : 0;
+            }
+        }
+    }
+
+    bool available() const {
+        return header_->head_.load(std::memory_order_acquire) != cursor_;
+    }
+
+    // Continue with the next sample published
+    void seek_latest() {
+        cursor_ = header_->head_.load(std::memory_order_acquire);
+    }
+
+    // Continue with the oldest sample still in the ring
+    void seek_oldest() {
+        uint64_t head = header_->head_.load(std::memory_order_acquire);
+        cursor_ = head > header_->capacity_ ? head - header_->capacity_ : 0;
+    }
+
+    // The publisher closed the bus or its process is gone
+    bool closed() const {
+        return header_->closed_.load(std::memory_order_acquire) != 0 ||
+               (kill(header_->publisher_pid_, 0) < 0 && errno == ESRCH);
+    }
+
+    // Samples overwritten before this subscriber read them
+    uint64_t lost() const {
+        return lost_;
+    }
+
+    uint64_t published() const {
+        return header_->head_.load(std::memory_order_acquire);
+    }
+
+    // Register snapshot from the publisher, LAST_ADDRESS entries
+    const uint16_t* registers() const {
+        return header_->registers_;
+    }
+
+    uint64_t start_ns() const {
+        return header_->start_ns_;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    // Seqlock read of sample n, false if it was overwritten meanwhile
+    bool load(uint64_t n, Sample& sample) const {
+        const ShmSlot& slot = slots_[n & mask_];
+        uint64_t seq = slot.seq_.load(std::memory_order_acquire);
+        if (seq != 2 * n + 2) {
+            return false;
+        }
+        uint64_t words[ShmSlot::WORDS];
+        for (size_t i = 0; i < ShmSlot::WORDS; i++) {
+            words[i] = slot.words_[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq_.load(std::memory_order_relaxed) != seq) {
+            return false;
+        }
+        CaptureRecord r;
+        memcpy(&r, words, sizeof(r));
+        sample.timestamp_ns_ = r.timestamp_ns_;
+        sample.x_ = r.x_;
+        sample.y_ = r.y_;
+        sample.z_ = r.z_;
+        sample.temp_ = r.temp_;
+        sample.set_count_ = r.set_count_;
+        sample.fresh_ = (r.flags_ & CaptureRecord::FRESH) != 0;
+        return true;
+    }
+
+    bool fail(int fd, const char* what) {
+        int err = errno;
+        ::close(fd);
+        error_ = what;
+        errno = err;
+        return false;
+    }
+
+    bool unmap(const char* what) {
+        int err = errno;
+        close();
+        error_ = what;
+        errno = err;
+        return false;
+    }
+
+    size_t bytes_ = 0;
+    const ShmHeader* header_ = nullptr;
+    const ShmSlot* slots_ = nullptr;
+    std::atomic<uint32_t>* wake_ = nullptr;
+    std::atomic<uint32_t>* waiters_ = nullptr;
+    uint64_t mask_ = 0;
+    uint64_t cursor_ = 0;
+    uint64_t lost_ = 0;
+    const char* error_ = "";
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_SHM
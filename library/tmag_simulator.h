@@ -0,0 +1,434 @@
+#ifndef TMAG5170Q1_SIMULATOR
+#define TMAG5170Q1_SIMULATOR
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "tmag_sensor.h"
+#include "tmag_convert.h"
+
+namespace TMAG5170Q1 {
+
+// Register level model of a TMAG5170-Q1 for running the driver without hardware.
+//
+// - register map of TMAG5170Q1Protocol::ADDRESS, written and read back over SPI frames
+// - tx CRC is checked, frames with a bad CRC are dropped and flagged with
+//   prev_crc_status_ in the next response
+// - read data is returned one frame late, like the real device
+// - X/Y/Z/TEMP results come from a configurable field function, converted
+//   with the ranges in SENSOR_CONFIG. Channels off in MAG_CH_EN or T_CH_EN
+//   read 0, ANGLE_RESULT follows the ANGLE_EN pair.
+// - conversions follow OPERATING_MODE: none in configuration, stand-by and
+//   sleep modes (the power on state), on a timer in ACTIVE_MEASURE_MODE and
+//   WAKE_UP_AND_SLEEP_MODE, where the timer follows SLEEPTIME. In
+//   ACTIVE_TRIGGER_MODE they start on a cmd0 START_AT_CS_LOW frame with
+//   TRIGGER_AT_SPI_COMMAND, or on trigger_pulse() for the CS and ALERT
+//   triggers. A triggered conversion completes one conversion time later,
+//   frames before that still read the previous result and triggers while
+//   it runs are ignored. advance() lets time pass without any SPI traffic.
+// - ALERT_CONFIG threshold alerts on the X/Y/Z/T_THRX_CONFIG bands: field
+//   thresholds compare with the top byte of the result code, the temperature
+//   one with degrees C. Axes outside their band show up in the rx status
+//   bits, the ALERT pin is reported through set_alert_handler(). A latched
+//   or RSLT_ALRT alert is released by reading CONV_STATUS.
+//
+// Use SimulatedTransport as the device transport, or define TMAG5170Q1_SIMULATOR_TRANSPORT
+// in exactly one translation unit to put it behind the TMAG_TransferFrame hooks.
+class TMAG5170Q1Simulator : public TMAG5170Q1Protocol {
+public:
+    struct Field {
+        double x_mT_;
+        double y_mT_;
+        double z_mT_;
+        double temp_C_;
+    };
+    typedef std::function<Field(double t)> FieldFunction;
+
+    TMAG5170Q1Simulator() {
+        field_ = [](double t) {
+            // 10 Hz rotation in the XY plane
+            Field f;
+            f.x_mT_ = 20.0 * std::cos(2 * M_PI * 10 * t);
+            f.y_mT_ = 20.0 * std::sin(2 * M_PI * 10 * t);
+            f.z_mT_ = 5.0;
+            f.temp_C_ = 25.0;
+            return f;
+        };
+        reset();
+    }
+
+    static TMAG5170Q1Simulator& instance() {
+        static TMAG5170Q1Simulator simulator;
+        return simulator;
+    }
+
+    // Power on reset, cfg_reset_ is reported until the host writes a register
+    void reset() {
+        memset(regs_, 0, sizeof(regs_));
+        out_ = 0;
+        crc_error_ = false;
+        cfg_reset_ = true;
+        set_count_ = 0;
+        time_ns_ = 0;
+        next_conversion_ns_ = 0;
+        trigger_pending_ = false;
+        frames_ = 0;
+        crc_errors_ = 0;
+        alert_axes_ = 0;
+        threshold_hits_ = 0;
+        set_alert(false);
+    }
+
+    void set_field(FieldFunction field) {
+        field_ = field;
+    }
+
+    // Simulated time per SPI frame and per conversion
+    void set_timing(uint64_t frame_ns, uint64_t conversion_ns) {
+        frame_ns_ = frame_ns;
+        conversion_ns_ = conversion_ns;
+    }
+
+    // Called with true when ALERT asserts (the pin goes low) and false when it releases
+    void set_alert_handler(std::function<void(bool)> handler) {
+        alert_handler_ = handler;
+    }
+
+    // Lets time pass without SPI traffic, running the timer conversions due
+    void advance(uint64_t ns) {
+        uint64_t end = time_ns_ + ns;
+        while (timer_mode() && next_conversion_ns_ <= end) {
+            time_ns_ = next_conversion_ns_ > time_ns_ ? next_conversion_ns_ : time_ns_;
+            convert();
+            if (next_conversion_ns_ <= time_ns_) {
+                break; // no conversion time set
+            }
+        }
+        if (trigger_pending_ && trigger_done_ns_ <= end) {
+            time_ns_ = trigger_done_ns_ > time_ns_ ? trigger_done_ns_ : time_ns_;
+            complete_trigger();
+        }
+        time_ns_ = end;
+    }
+
+    void transfer(const uint8_t tx[4], uint8_t rx[4]) {
+        uint32_t txw = to_word(tx);
+
+        // status reflects the state before this frame
+        uint8_t status = uint8_t((crc_error_ ? 0x80 : 0) | (cfg_reset_ ? 0x40 : 0) | alert_axes_);
+        uint16_t data = out_;
+
+        time_ns_ += frame_ns_;
+        frames_++;
+        if (time_ns_ >= next_conversion_ns_ && timer_mode()) {
+            convert();
+        }
+        complete_trigger();
+
+        crc_error_ = !FrameCodec::crc_ok(txw);
+        unsigned int stat = set_count_ & 0x7;
+        if (crc_error_) {
+            crc_errors_++;
+            out_ = 0;
+        } else {
+            unsigned int address = FrameCodec::tx_address(txw);
+            if (FrameCodec::tx_rw(txw) == RW::READ) {
+                out_ = address < LAST_ADDRESS ? regs_[address] : 0;
+                if (address == CONV_STATUS) {
+                    release_alert();
+                }
+            } else {
+                if (address < LAST_ADDRESS && writable(address)) {
+                    regs_[address] = FrameCodec::data(txw);
+                    cfg_reset_ = false;
+                    if (address == DEVICE_CONFIG) {
+                        // the first result of a new mode takes a full conversion
+                        next_conversion_ns_ = time_ns_ + conversion_interval();
+                    }
+                }
+                out_ = 0;
+            }
+            if (FrameCodec::tx_stat012_info(txw) == DATA_TYPE) {
+                stat = 0; // register data
+            }
+            if (FrameCodec::tx_start_conversion(txw) == START_AT_CS_LOW && trigger_mode() &&
+                trigger_source() == TRIGGER_AT_SPI_COMMAND) {
+                start_trigger();
+            }
+        }
+
+        FrameCodec::to_bytes(FrameCodec::encode_rx(status, data, stat, false), rx);
+    }
+
+    void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            transfer(tx[i], rx[i]);
+        }
+    }
+
+    // A CS or ALERT trigger pulse, converts in ACTIVE_TRIGGER_MODE with that trigger
+    void trigger_pulse() {
+        if (trigger_mode() && trigger_source() != TRIGGER_AT_SPI_COMMAND) {
+            start_trigger();
+        }
+    }
+
+    void start_trigger() {
+        if (!trigger_pending_) {
+            trigger_pending_ = true;
+            trigger_done_ns_ = time_ns_ + conversion_ns_;
+        }
+    }
+
+    void complete_trigger() {
+        if (trigger_pending_ && time_ns_ >= trigger_done_ns_) {
+            trigger_pending_ = false;
+            convert();
+        }
+    }
+
+    // Latches a new set of results from the field function
+    void convert() {
+        Field f = field_(time_ns_ * 1e-9);
+        Data config, device_config;
+        config.raw_ = regs_[SENSOR_CONFIG];
+        device_config.raw_ = regs_[DEVICE_CONFIG];
+        unsigned int channels = enabled_channels(config.sensor_config_.mag_ch_en_);
+        int16_t x = (channels & MAG_CH_X) ? to_code(f.x_mT_, range_mT(config.sensor_config_.x_range_)) : 0;
+        int16_t y = (channels & MAG_CH_Y) ? to_code(f.y_mT_, range_mT(config.sensor_config_.y_range_)) : 0;
+        int16_t z = (channels & MAG_CH_Z) ? to_code(f.z_mT_, range_mT(config.sensor_config_.z_range_)) : 0;
+        regs_[X_CH_RESULT] = x;
+        regs_[Y_CH_RESULT] = y;
+        regs_[Z_CH_RESULT] = z;
+        regs_[TEMP_RESULT] = device_config.device_config_.t_ch_en_ ?
+            static_cast<uint16_t>(std::lround(TEMP_ADC_T0 + (f.temp_C_ - TEMP_T0_C) * TEMP_ADC_RES)) : 0;
+
+        regs_[ANGLE_RESULT] = 0;
+        regs_[MAGNITUDE_RESULT] = 0;
+        if (config.sensor_config_.angle_en_ != ANGLE_OFF) {
+            // XY, YZ, XZ: angle of the second axis against the first
+            int16_t first = config.sensor_config_.angle_en_ == ANGLE_YZ ? y : x;
+            int16_t second = config.sensor_config_.angle_en_ == ANGLE_XY ? y : z;
+            double angle = std::atan2(double(second), double(first)) * 180.0 / M_PI;
+            if (angle < 0) {
+                angle += 360.0;
+            }
+            regs_[ANGLE_RESULT] = static_cast<uint16_t>(std::lround(angle * 16)) & 0x1FFF;
+            regs_[MAGNITUDE_RESULT] = static_cast<uint16_t>(std::lround(std::hypot(double(first), double(second)) / 16)) & 0xFFF;
+        }
+
+        set_count_ = (set_count_ + 1) & 0x7;
+        regs_[CONV_STATUS] = static_cast<uint16_t>(0x2000 | (set_count_ << 4));
+        next_conversion_ns_ = time_ns_ + conversion_interval();
+        check_alert(x, y, z, f.temp_C_);
+    }
+
+    bool trigger_mode() const {
+        Data config;
+        config.raw_ = regs_[DEVICE_CONFIG];
+        return config.device_config_.operating_mode_ == ACTIVE_TRIGGER_MODE;
+    }
+
+    // Modes converting on their own
+    bool timer_mode() const {
+        Data config;
+        config.raw_ = regs_[DEVICE_CONFIG];
+        return config.device_config_.operating_mode_ == ACTIVE_MEASURE_MODE ||
+               config.device_config_.operating_mode_ == WAKE_UP_AND_SLEEP_MODE;
+    }
+
+    unsigned int trigger_source() const {
+        Data config;
+        config.raw_ = regs_[SYSTEM_CONFIG];
+        return config.system_config_.trigger_mode_;
+    }
+
+    // MAG_CH_EN as a MAG_CH_X | MAG_CH_Y | MAG_CH_Z mask, 8..B are the
+    // pseudo-simultaneous XYX, YXY, YZY and XZX sequences
+    static unsigned int enabled_channels(unsigned int mag_ch_en) {
+        static const unsigned int sequences[4] = { MAG_CH_XY, MAG_CH_XY, MAG_CH_YZ, MAG_CH_XZ };
+        if (mag_ch_en <= MAG_CH_XYZ) {
+            return mag_ch_en;
+        }
+        return mag_ch_en <= 0xB ? sequences[mag_ch_en - 8] : 0u;
+    }
+
+    uint64_t conversion_interval() const {
+        static const uint64_t sleeptime_ms[16] = { 1, 5, 10, 15, 20, 30, 50, 100, 500, 1000, 1000, 1000, 1000, 1000, 1000, 1000 };
+        Data device_config, sensor_config;
+        device_config.raw_ = regs_[DEVICE_CONFIG];
+        sensor_config.raw_ = regs_[SENSOR_CONFIG];
+        if (device_config.device_config_.operating_mode_ == WAKE_UP_AND_SLEEP_MODE) {
+            return sleeptime_ms[sensor_config.sensor_config_.sleeptime_] * 1000000;
+        }
+        return conversion_ns_;
+    }
+
+    bool outside(unsigned int address, int value) const {
+        Data band;
+        band.raw_ = regs_[address];
+        return value > band.threshold_.high_ || value < band.threshold_.low_;
+    }
+
+    void check_alert(int16_t x, int16_t y, int16_t z, double temp_C) {
+        Data config;
+        config.raw_ = regs_[ALERT_CONFIG];
+        uint8_t axes = 0;
+        if (config.alert_config_.x_thrx_alrt_ && outside(X_THRX_CONFIG, x >> 8)) axes |= 0x08;
+        if (config.alert_config_.y_thrx_alrt_ && outside(Y_THRX_CONFIG, y >> 8)) axes |= 0x04;
+        if (config.alert_config_.z_thrx_alrt_ && outside(Z_THRX_CONFIG, z >> 8)) axes |= 0x02;
+        if (config.alert_config_.t_thrx_alrt_ && outside(T_THRX_CONFIG, int(std::lround(temp_C)))) axes |= 0x01;
+        alert_axes_ = axes;
+
+        if (axes) {
+            if (++threshold_hits_ > config.alert_config_.thrx_count_) {
+                set_alert(true);
+            }
+        } else {
+            threshold_hits_ = 0;
+            if (!config.alert_config_.alert_latch_ && !config.alert_config_.rslt_alrt_) {
+                set_alert(false);
+            }
+        }
+        if (config.alert_config_.rslt_alrt_) {
+            set_alert(true);
+        }
+    }
+
+    void release_alert() {
+        Data config;
+        config.raw_ = regs_[ALERT_CONFIG];
+        if (config.alert_config_.alert_latch_ || config.alert_config_.rslt_alrt_ || !alert_axes_) {
+            set_alert(false);
+        }
+    }
+
+    void set_alert(bool asserted) {
+        if (asserted != alert_) {
+            alert_ = asserted;
+            if (alert_handler_) {
+                alert_handler_(asserted);
+            }
+        }
+    }
+
+    static int16_t to_code(double mT, double range) {
+        long code = std::lround(mT * 32768.0 / range);
+        if (code > 32767) code = 32767;
+        if (code < -32768) code = -32768;
+        return static_cast<int16_t>(code);
+    }
+
+    static bool writable(unsigned int address) {
+        return address <= T_THRX_CONFIG || address == TEST_CONFIG || address == MAG_GAIN_CONFIG;
+    }
+
+    uint16_t regs_[LAST_ADDRESS];
+    uint16_t out_;              // data for the next response frame
+    bool crc_error_;
+    bool cfg_reset_;
+    unsigned int set_count_;
+    uint64_t time_ns_;
+    uint64_t next_conversion_ns_;
+    bool trigger_pending_;      // triggered conversion running
+    uint64_t trigger_done_ns_;
+    uint64_t frame_ns_ = 3200;          // 32 bits at 10 MHz
+    uint64_t conversion_ns_ = 100000;
+    uint64_t frames_;
+    uint64_t crc_errors_;
+    bool alert_ = false;        // ALERT pin asserted
+    uint8_t alert_axes_;        // rx status bits of the axes outside their band
+    unsigned int threshold_hits_;
+    std::function<void(bool)> alert_handler_;
+    FieldFunction field_;
+};
+
+// Device transport talking to a simulator, by default the shared instance()
+class SimulatedTransport {
+public:
+    explicit SimulatedTransport(TMAG5170Q1Simulator& simulator = TMAG5170Q1Simulator::instance()) : simulator_(&simulator) {}
+
+    void transfer(const uint8_t tx[4], uint8_t rx[4]) {
+        simulator_->transfer(tx, rx);
+    }
+
+    void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        simulator_->transfer(tx, rx, count);
+    }
+
+    TMAG5170Q1Simulator& simulator() {
+        return *simulator_;
+    }
+
+private:
+    TMAG5170Q1Simulator* simulator_;
+};
+
+// ALERT line of a simulator as an eventfd, an edge is queued whenever the
+// simulated pin asserts. Simulated time only moves with frames and
+// TMAG5170Q1Simulator::advance(), so drive the simulator before waiting.
+class SimulatedAlertPin {
+public:
+    explicit SimulatedAlertPin(TMAG5170Q1Simulator& simulator = TMAG5170Q1Simulator::instance())
+        : simulator_(simulator) {
+        fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+        simulator_.set_alert_handler([this](bool asserted) {
+            if (asserted && fd_ >= 0) {
+                edge_ns_ = simulator_.time_ns_;
+                uint64_t one = 1;
+                if (write(fd_, &one, sizeof(one)) != sizeof(one)) {
+                    lost_++;
+                }
+            }
+        });
+    }
+
+    SimulatedAlertPin(const SimulatedAlertPin&) = delete;
+    SimulatedAlertPin& operator=(const SimulatedAlertPin&) = delete;
+
+    ~SimulatedAlertPin() {
+        simulator_.set_alert_handler(nullptr);
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    // ns is simulated time of the latest edge
+    bool consume(uint64_t& ns) {
+        uint64_t value;
+        if (read(fd_, &value, sizeof(value)) != sizeof(value)) {
+            return false;
+        }
+        ns = edge_ns_;
+        return true;
+    }
+
+    uint64_t lost() const {
+        return lost_;
+    }
+
+private:
+    TMAG5170Q1Simulator& simulator_;
+    int fd_ = -1;
+    uint64_t edge_ns_ = 0;
+    uint64_t lost_ = 0;
+};
+
+}
+
+#ifdef TMAG5170Q1_SIMULATOR_TRANSPORT
+void TMAG_TransferFrame(const uint8_t tx[4], uint8_t rx[4]) {
+    TMAG5170Q1::TMAG5170Q1Simulator::instance().transfer(tx, rx);
+}
+
+void TMAG_TransferFrames(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+    TMAG5170Q1::TMAG5170Q1Simulator::instance().transfer(tx, rx, count);
+}
+#endif
+
+#endif //#ifndef TMAG5170Q1_SIMULATOR
@@ -0,0 +1,198 @@
+#ifndef TMAG5170Q1_STREAM
+#define TMAG5170Q1_STREAM
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "tmag_sensor.h"
+#include "tmag_ring.h"
+
+namespace TMAG5170Q1 {
+
+// One X/Y/Z/TEMP conversion result set as raw codes
+struct Sample {
+    uint64_t timestamp_ns_; // steady clock, taken after the result frames
+    int16_t x_;
+    int16_t y_;
+    int16_t z_;
+    int16_t temp_;
+    uint8_t set_count_;     // STAT012 SET_COUNT of the conversion
+    bool fresh_;            // false if no conversion happened since the previous sample
+};
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time between conversions for a DEVICE_CONFIG / SENSOR_CONFIG pair, 0
+// when the device does not convert on its own. Rounded up from the data
+// sheet rates, CONV_AVG 1x..32x: 20.0..1.2 kSPS for one channel and
+// 10.0..0.4 kSPS for three, a second channel is taken as three.
+inline uint64_t conversion_period_ns(TMAG5170Q1Protocol::Data device_config, TMAG5170Q1Protocol::Data sensor_config) {
+    typedef TMAG5170Q1Protocol P;
+    static const uint64_t one_channel_ns[8] = { 50000, 75200, 125000, 227300, 416700, 833400, 833400, 833400 };
+    static const uint64_t three_channels_ns[8] = { 100000, 175500, 322600, 625000, 1250000, 2500000, 2500000, 2500000 };
+    static const uint64_t sleeptime_ms[16] = { 1, 5, 10, 15, 20, 30, 50, 100, 500, 1000, 1000, 1000, 1000, 1000, 1000, 1000 };
+    unsigned int mode = device_config.device_config_.operating_mode_;
+    if (mode != P::ACTIVE_MEASURE_MODE && mode != P::WAKE_UP_AND_SLEEP_MODE) {
+        return 0;
+    }
+    unsigned int mag = sensor_config.sensor_config_.mag_ch_en_;
+    unsigned int channels = (mag & 1) + ((mag >> 1) & 1) + ((mag >> 2) & 1) + (mag >= 8 ? 2 : 0);
+    unsigned int conv_avg = device_config.device_config_.conv_avg_;
+    uint64_t conversion = channels + device_config.device_config_.t_ch_en_ > 1 ?
+        three_channels_ns[conv_avg] : one_channel_ns[conv_avg];
+    if (mode == P::WAKE_UP_AND_SLEEP_MODE) {
+        return sleeptime_ms[sensor_config.sensor_config_.sleeptime_] * 1000000 + conversion;
+    }
+    return conversion;
+}
+
+// SET_COUNT state of one device for read_sample().
+//
+// SET_COUNT only has 3 bits. Polled at 1 / (8 k) of the conversion rate
+// every new conversion shows the count of the previous one and would pass
+// for a duplicate forever. A matching count is therefore still read as a
+// new sample once 8 conversion periods (plus 25 %) passed since the last
+// one, the period taken from the DEVICE_CONFIG and SENSOR_CONFIG the
+// device last wrote. Without a known period, a device configured
+// elsewhere, max_duplicates_ consecutive matches do the same, which can
+// pass one real duplicate when polls are that much faster than the
+// conversions. 0 disables it.
+struct SetCountTracker {
+    int last_ = -1;
+    unsigned int duplicates_ = 0;       // consecutive matches so far
+    uint64_t last_ns_ = 0;              // timestamp of the last sample read
+    unsigned int max_duplicates_ = 16;
+
+    template <class Device>
+    bool aliased(const Device& device) {
+        duplicates_++;
+        uint64_t period = conversion_period_ns(device.datamem[Device::DEVICE_CONFIG],
+                                               device.datamem[Device::SENSOR_CONFIG]);
+        if (period > 0) {
+            return now_ns() - last_ns_ >= 10 * period;
+        }
+        return max_duplicates_ > 0 && duplicates_ > max_duplicates_;
+    }
+};
+
+// Reads X/Y/Z/TEMP if the device converted since the last sample.
+//
+// The X read goes out alone first, its response carries the current
+// SET_COUNT. When that matches the tracker the result would be a
+// duplicate, sample is only re-tagged as not fresh and false is returned
+// after a single frame. The X read stays in flight and is collected by the
+// next frame. Otherwise Y/Z/TEMP follow in one batch, five frames in total.
+// When the device does not report SET_COUNT every sample counts as fresh.
+// See SetCountTracker for polls slower than 1 / 8 of the conversion rate.
+template <class Device>
+bool read_sample(Device& device, Sample& sample, SetCountTracker& tracker) {
+    static const std::vector<typename Device::ADDRESS> rest = {
+        Device::Y_CH_RESULT, Device::Z_CH_RESULT, Device::TEMP_RESULT };
+
+    device.read_pipelined(Device::X_CH_RESULT);
+    if (device.set_count_ >= 0 && device.set_count_ == tracker.last_ && !tracker.aliased(device)) {
+        sample.fresh_ = false;
+        return false;
+    }
+    int set_count = device.set_count_;
+    device.read_data(rest);
+
+    sample.timestamp_ns_ = now_ns();
+    sample.x_ = device.datamem[Device::X_CH_RESULT].result_.value_;
+    sample.y_ = device.datamem[Device::Y_CH_RESULT].result_.value_;
+    sample.z_ = device.datamem[Device::Z_CH_RESULT].result_.value_;
+    sample.temp_ = device.datamem[Device::TEMP_RESULT].result_.value_;
+    sample.set_count_ = uint8_t(set_count & 0x7);
+    sample.fresh_ = true;
+    tracker.last_ = set_count;
+    tracker.duplicates_ = 0;
+    tracker.last_ns_ = sample.timestamp_ns_;
+    return true;
+}
+
+// Runs an acquisition thread that reads X/Y/Z/TEMP with read_sample() and
+// publishes fresh samples into a lock-free SPSC ring. Polls that find no
+// new conversion cost one frame and publish nothing.
+// The device must not be used by anyone else while streaming.
+//
+//   SampleStreamer<TMAG5170Q1Device> streamer(dev);
+//   streamer.start(std::chrono::microseconds(500));
+//   Sample s;
+//   while (streamer.pop(s)) { ... }
+template <class Device, size_t Capacity = 1024>
+class SampleStreamer {
+public:
+    explicit SampleStreamer(Device& device) : device_(device) {}
+
+    ~SampleStreamer() {
+        stop();
+    }
+
+    // period 0 samples as fast as the bus allows
+    void start(std::chrono::nanoseconds period = std::chrono::nanoseconds(0)) {
+        if (thread_.joinable()) {
+            return;
+        }
+        running_.store(true, std::memory_order_relaxed);
+        thread_ = std::thread([this, period] { run(period); });
+    }
+
+    void stop() {
+        running_.store(false, std::memory_order_relaxed);
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    // Consumer side, never blocks
+    bool pop(Sample& sample) {
+        return ring_.pop(sample);
+    }
+
+    // Samples lost because the consumer fell behind
+    uint64_t dropped() const {
+        return ring_.dropped();
+    }
+
+    uint64_t produced() const {
+        return produced_.load(std::memory_order_relaxed);
+    }
+
+    // Polls that found no new conversion
+    uint64_t duplicates() const {
+        return duplicates_.load(std::memory_order_relaxed);
+    }
+
+private:
+    void run(std::chrono::nanoseconds period) {
+        auto next = std::chrono::steady_clock::now();
+        SetCountTracker tracker;
+        Sample sample = Sample();
+        while (running_.load(std::memory_order_relaxed)) {
+            if (read_sample(device_, sample, tracker)) {
+                ring_.push(sample);
+                produced_.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                duplicates_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            if (period.count() > 0) {
+                next += period;
+                std::this_thread::sleep_until(next);
+            }
+        }
+    }
+
+    Device& device_;
+    SPSCRing<Sample, Capacity> ring_;
+    std::atomic<bool> running_{false};
+    std::atomic<uint64_t> produced_{0};
+    std::atomic<uint64_t> duplicates_{0};
+    std::thread thread_;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_STREAM
@@ -0,0 +1,48 @@
+#ifndef TMAG5170Q1_THREAD
+#define TMAG5170Q1_THREAD
+#include <pthread.h>
+#include <sched.h>
+#include <cstring>
+
+namespace TMAG5170Q1 {
+
+// Where a thread runs: core to pin to (-1 any) and SCHED_FIFO priority
+// (0 stays SCHED_OTHER)
+struct ThreadPlacement {
+    int cpu = -1;
+    int priority = 0;
+};
+
+// Applies placement to the calling thread. Returns 0 or the pthread error,
+// with *what naming the step that failed.
+inline int place_thread(const ThreadPlacement& placement, const char** what = nullptr) {
+    if (placement.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(placement.cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            if (what) {
+                *what = "can't set cpu affinity";
+            }
+            return err;
+        }
+    }
+    if (placement.priority > 0) {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = placement.priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            if (what) {
+                *what = "can't set SCHED_FIFO priority";
+            }
+            return err;
+        }
+    }
+    return 0;
+}
+
+}
+
+#endif //#ifndef TMAG5170Q1_THREAD
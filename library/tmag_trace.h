@@ -0,0 +1,78 @@
+#ifndef TMAG5170Q1_TRACE
+#define TMAG5170Q1_TRACE
+#include <chrono>
+#include "tmag_sensor.h"
+
+namespace TMAG5170Q1 {
+
+// Trace policy that stores raw frames in a fixed size ring buffer,
+// oldest records are overwritten. No formatting in the transfer path,
+// dump() writes the records for offline decoding.
+//
+//   TMAG5170Q1DeviceT< ExternTransport, BinaryTrace<4096> > dev;
+template <size_t Capacity>
+class BinaryTrace {
+    static_assert(Capacity > 0, "Capacity must not be zero");
+public:
+    struct Record {
+        uint64_t timestamp_ns_; // steady clock
+        uint32_t tx_;           // frame bytes, tx[0] in bits 0..7
+        uint32_t rx_;
+    };
+
+    void mark(TRACE_PHASE) {}
+
+    void frame(uint32_t tx, uint32_t rx) {
+        Record& record = records_[count_ % Capacity];
+        record.timestamp_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        record.tx_ = tx;
+        record.rx_ = rx;
+        count_++;
+    }
+
+    size_t size() const {
+        return count_ < Capacity ? count_ : Capacity;
+    }
+
+    // Records lost to wrap around
+    uint64_t dropped() const {
+        return count_ - size();
+    }
+
+    // i = 0 is the oldest record still held
+    const Record& operator[](size_t i) const {
+        return records_[(count_ - size() + i) % Capacity];
+    }
+
+    void clear() {
+        count_ = 0;
+    }
+
+    // Writes the records oldest first as raw Record structs
+    bool dump(FILE* f) const {
+        for (size_t i = 0; i < size(); i++) {
+            if (fwrite(&(*this)[i], sizeof(Record), 1, f) != 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Human readable listing, meant for offline use
+    void print(FILE* f) const {
+        for (size_t i = 0; i < size(); i++) {
+            const Record& r = (*this)[i];
+            fprintf(f, "%llu tx:%08x rx:%08x\n",
+                (unsigned long long)r.timestamp_ns_, (unsigned int)r.tx_, (unsigned int)r.rx_);
+        }
+    }
+
+private:
+    Record records_[Capacity];
+    uint64_t count_ = 0;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_TRACE
@@ -0,0 +1,206 @@
+#ifndef TMAG5170Q1_TRANSPORT
+#define TMAG5170Q1_TRANSPORT
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include "tmag_sensor.h"
+
+namespace TMAG5170Q1 {
+
+// One SPI frame as sent and answered, tx[0]/rx[0] in bits 0..7
+struct FrameRecord {
+    uint32_t tx_;
+    uint32_t rx_;
+};
+static_assert(sizeof(FrameRecord) == 8, "Frame record layout");
+
+// Recording file: RECORDING_MAGIC, uint64_t count, FrameRecord[count],
+// host byte order
+static const char RECORDING_MAGIC[8] = { 'T', 'M', 'A', 'G', 'R', 'E', 'C', '1' };
+
+// Writes records to path, returns false with errno set on failure
+inline bool save_recording(const char* path, const FrameRecord* records, uint64_t count) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(RECORDING_MAGIC, sizeof(RECORDING_MAGIC), 1, f) == 1 &&
+              fwrite(&count, sizeof(count), 1, f) == 1 &&
+              (count == 0 || fwrite(records, sizeof(FrameRecord), count, f) == count);
+    int err = errno;
+    if (fclose(f) != 0) {
+        ok = false;
+        err = errno;
+    }
+    errno = err;
+    return ok;
+}
+
+// Replaces records with the contents of path, returns false on failure
+inline bool load_recording(const char* path, std::vector<FrameRecord>& records) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    char magic[sizeof(RECORDING_MAGIC)];
+    uint64_t count = 0;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+              memcmp(magic, RECORDING_MAGIC, sizeof(magic)) == 0 &&
+              fread(&count, sizeof(count), 1, f) == 1;
+    if (ok) {
+        records.resize(count);
+        ok = count == 0 || fread(records.data(), sizeof(FrameRecord), count, f) == count;
+    }
+    if (!ok && !ferror(f)) {
+        errno = EINVAL;
+    }
+    int err = errno;
+    fclose(f);
+    errno = err;
+    return ok;
+}
+
+// Passes frames to an inner transport and keeps every tx/rx pair
+//
+//   TMAG5170Q1DeviceT< RecordingTransport<SimulatedTransport> > dev;
+//   dev.transport_.records();
+//
+// Without reserve() the records grow as needed. After reserve(frames) the
+// recorder never allocates again: frames past that many are passed on but
+// not kept, and are counted in dropped(). That suits a real-time loop.
+template <class Inner>
+class RecordingTransport {
+public:
+    typedef FrameRecord Record;
+
+    explicit RecordingTransport(Inner inner = Inner()) : inner_(inner) {}
+
+    void transfer(const uint8_t tx[4], uint8_t rx[4]) {
+        inner_.transfer(tx, rx);
+        record(tx, rx);
+    }
+
+    void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        inner_.transfer(tx, rx, count);
+        for (size_t i = 0; i < count; i++) {
+            record(tx[i], rx[i]);
+        }
+    }
+
+    // Allocates room for frames records up front and caps the recording there
+    void reserve(size_t frames) {
+        records_.reserve(frames);
+        limit_ = frames;
+    }
+
+    const std::vector<Record>& records() const {
+        return records_;
+    }
+
+    // Frames not kept because the reserved room was used up
+    uint64_t dropped() const {
+        return dropped_;
+    }
+
+    void clear() {
+        records_.clear();
+        dropped_ = 0;
+    }
+
+    Inner& inner() {
+        return inner_;
+    }
+
+    bool save(const char* path) const {
+        return save_recording(path, records_.data(), records_.size());
+    }
+
+private:
+    void record(const uint8_t tx[4], const uint8_t rx[4]) {
+        if (limit_ > 0 && records_.size() == limit_) {
+            dropped_++;
+            return;
+        }
+        Record r = { TMAG5170Q1Protocol::to_word(tx), TMAG5170Q1Protocol::to_word(rx) };
+        records_.push_back(r);
+    }
+
+    Inner inner_;
+    std::vector<Record> records_;
+    size_t limit_ = 0;          // reserve()d frames, 0 grows without limit
+    uint64_t dropped_ = 0;
+};
+
+// Answers each frame with the next recorded rx word, no bus and no timing,
+// so a recording from the field drives the device and everything above it
+// as fast as the host runs. The records are not copied and must outlive the
+// transport.
+//
+//   std::vector<FrameRecord> frames;
+//   load_recording("field.rec", frames);
+//   TMAG5170Q1DeviceT<ReplayTransport> dev{ReplayTransport(frames)};
+//
+// A tx word that differs from the recorded one is counted in mismatches(),
+// the replay continues with the recorded answer. Past the end the transport
+// answers zero words, or starts over when looping.
+class ReplayTransport {
+public:
+    ReplayTransport(const FrameRecord* records, size_t count, bool loop = false)
+        : records_(records), count_(count), loop_(loop) {}
+
+    explicit ReplayTransport(const std::vector<FrameRecord>& records, bool loop = false)
+        : ReplayTransport(records.data(), records.size(), loop) {}
+
+    void transfer(const uint8_t tx[4], uint8_t rx[4]) {
+        FrameCodec::to_bytes(next(TMAG5170Q1Protocol::to_word(tx)), rx);
+    }
+
+    void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            transfer(tx[i], rx[i]);
+        }
+    }
+
+    // Next record to be replayed
+    size_t position() const {
+        return position_;
+    }
+
+    bool done() const {
+        return !loop_ && position_ >= count_;
+    }
+
+    uint64_t mismatches() const {
+        return mismatches_;
+    }
+
+    void rewind() {
+        position_ = 0;
+        mismatches_ = 0;
+    }
+
+private:
+    uint32_t next(uint32_t tx) {
+        if (position_ >= count_) {
+            if (!loop_ || count_ == 0) {
+                return 0;
+            }
+            position_ = 0;
+        }
+        const FrameRecord& r = records_[position_++];
+        if (r.tx_ != tx) {
+            mismatches_++;
+        }
+        return r.rx_;
+    }
+
+    const FrameRecord* records_;
+    size_t count_;
+    size_t position_ = 0;
+    uint64_t mismatches_ = 0;
+    bool loop_;
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_TRANSPORT
@@ -0,0 +1,106 @@
+#ifndef TMAG5170Q1_GPIO_ALERT
+#define TMAG5170Q1_GPIO_ALERT
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+namespace TMAG5170Q1 {
+
+// The ALERT pin on a GPIO line, through the gpio character device (uAPI
+// v2, Linux 5.10+). ALERT is open drain and active low, the line is
+// requested as an input with pull-up and falling edge events, which the
+// kernel timestamps and queues until consume().
+//
+//   GpioAlertPin pin;
+//   if (!pin.open("/dev/gpiochip0", 25)) perror(pin.error());
+class GpioAlertPin {
+public:
+    GpioAlertPin() = default;
+    GpioAlertPin(const GpioAlertPin&) = delete;
+    GpioAlertPin& operator=(const GpioAlertPin&) = delete;
+
+    ~GpioAlertPin() {
+        close();
+    }
+
+    // Returns false with errno set and error() naming the step that failed
+    bool open(const char* chip, unsigned int line) {
+        close();
+        int chip_fd = ::open(chip, O_RDWR | O_CLOEXEC);
+        if (chip_fd < 0) {
+            error_ = "can't open gpio chip";
+            return false;
+        }
+        gpio_v2_line_request request;
+        memset(&request, 0, sizeof(request));
+        request.offsets[0] = line;
+        request.num_lines = 1;
+        request.event_buffer_size = 16;
+        request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING |
+                               GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+        strncpy(request.consumer, "tmag5170 alert", sizeof(request.consumer) - 1);
+        int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request);
+        int err = errno;
+        ::close(chip_fd);
+        if (ret < 0) {
+            errno = err;
+            error_ = "can't request alert line";
+            return false;
+        }
+        fd_ = request.fd;
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    // ns is the kernel's CLOCK_MONOTONIC timestamp of the edge
+    bool consume(uint64_t& ns) {
+        gpio_v2_line_event event;
+        ssize_t n;
+        do {
+            n = read(fd_, &event, sizeof(event));
+        } while (n < 0 && errno == EINTR);
+        if (n != sizeof(event)) {
+            error_ = "can't read alert edge";
+            return false;
+        }
+        ns = event.timestamp_ns;
+        if (event.line_seqno > 0 && last_seqno_ > 0 && event.line_seqno != last_seqno_ + 1) {
+            lost_ += event.line_seqno - last_seqno_ - 1;
+        }
+        last_seqno_ = event.line_seqno;
+        return true;
+    }
+
+    // Edges the kernel dropped from a full event buffer
+    uint64_t lost() const {
+        return lost_;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    int fd_ = -1;
+    uint32_t last_seqno_ = 0;
+    uint64_t lost_ = 0;
+    const char* error_ = "";
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_GPIO_ALERT
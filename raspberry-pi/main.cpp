@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -22,6 +23,13 @@
 #include <linux/spi/spidev.h>
 
 #include "../library/tmag_sensor.h"
+#include "../library/tmag_capture.h"
+#include "../library/tmag_shm.h"
+#include "../library/tmag_transport.h"
+#include "spi_bus.h"
+#include "rt_runner.h"
+#include "gpio_alert.h"
+#include "../library/tmag_alert.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -31,39 +39,27 @@ static void pabort(const char *s)
 	abort();
 }
 
-static const char *device = "/dev/spidev0.0";
+/* one sensor per -D option */
+#define MAX_DEVICES 8
+static const char *devices[MAX_DEVICES];
+static int num_devices = 0;
 static uint8_t mode = 0;
 static uint8_t bits = 8;
 static uint32_t speed = 100000;
 static uint16_t delay = 0;
+static const char *output = NULL;
+static const char *recording = NULL;
+static const char *shm_name = NULL;
+static uint32_t period_us = 0;
+static TMAG5170Q1::RtConfig rt;
+static bool realtime = false;
+static uint64_t num_samples = 1;
+static const char *alert_chip = NULL;
+static unsigned int alert_line = 0;
+static float alert_mT = 10.0f;
 
 
 
-extern "C" void TMAG_TransferFrame(const uint8_t tx[4], uint8_t rx[4]);
-
-static int open_fd = -1;
-void TMAG_TransferFrame(const uint8_t tx[4], uint8_t rx[4]) {
-
-    int ret; 
-    int fd = open_fd;
-
-    	struct spi_ioc_transfer tr = {
-		.tx_buf = (unsigned long)tx,
-		.rx_buf = (unsigned long)rx,
-		.len = sizeof(uint8_t) * 4,
-		.speed_hz = speed,
-		.delay_usecs = delay,
-		.bits_per_word = bits,
-	};
-
-	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
-	if (ret < 1)
-		pabort("can't send spi message");
-
-
-}
-
-
 static void transfer(int fd)
 {
 	int ret;
@@ -77,14 +73,14 @@ static void transfer(int fd)
 		0xF0, 0x0D,
 	};
 	uint8_t rx[ARRAY_SIZE(tx)] = {0, };
-	struct spi_ioc_transfer tr = {
-		.tx_buf = (unsigned long)tx,
-		.rx_buf = (unsigned long)rx,
-		.len = ARRAY_SIZE(tx),
-		.speed_hz = speed,
-		.delay_usecs = delay,
-		.bits_per_word = bits,
-	};
+	struct spi_ioc_transfer tr;
+	memset(&tr, 0, sizeof(tr));
+	tr.tx_buf = (unsigned long)tx;
+	tr.rx_buf = (unsigned long)rx;
+	tr.len = ARRAY_SIZE(tx);
+	tr.speed_hz = speed;
+	tr.delay_usecs = delay;
+	tr.bits_per_word = bits;
 
 	ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
 	if (ret < 1)
@@ -101,7 +97,7 @@ static void transfer(int fd)
 static void print_usage(const char *prog)
 {
 	printf("Usage: %s [-DsbdlHOLC3]\n", prog);
-	puts("  -D --device   device to use (default /dev/spidev1.1)\n"
+	puts("  -D --device   device to use, repeat for more sensors (default /dev/spidev0.0)\n"
 	     "  -s --speed    max speed (Hz)\n"
 	     "  -d --delay    delay (usec)\n"
 	     "  -b --bpw      bits per word \n"
@@ -110,7 +106,17 @@ static void print_usage(const char *prog)
 	     "  -O --cpol     clock polarity\n"
 	     "  -L --lsb      least significant bit first\n"
 	     "  -C --cs-high  chip select active high\n"
-	     "  -3 --3wire    SI/SO signals shared\n");
+	     "  -3 --3wire    SI/SO signals shared\n"
+	     "  -o --output   capture file, one per sensor with .N appended when several\n"
+	     "  -n --samples  samples to capture per sensor (default 1)\n"
+	     "  -r --record   save the raw tx/rx frames for replay, .N appended as for -o\n"
+	     "  -S --shm      publish samples on a shared memory bus (/name), .N appended as for -o\n"
+	     "  -p --period   sample period (usec), runs on the real-time acquisition thread\n"
+	     "  -P --priority SCHED_FIFO priority of the acquisition thread\n"
+	     "  -c --cpu      pin the acquisition thread to this core\n"
+	     "  -m --mlock    lock all memory\n"
+	     "  -a --alert    wait for -n threshold alerts on gpiochip:line instead of polling\n"
+	     "  -T --threshold alert when |X|, |Y| or |Z| exceeds this (mT, default 10)\n");
 	exit(1);
 }
 
@@ -130,18 +136,30 @@ static void parse_opts(int argc, char *argv[])
 			{ "3wire",   0, 0, '3' },
 			{ "no-cs",   0, 0, 'N' },
 			{ "ready",   0, 0, 'R' },
+			{ "output",  1, 0, 'o' },
+			{ "samples", 1, 0, 'n' },
+			{ "record",  1, 0, 'r' },
+			{ "shm",     1, 0, 'S' },
+			{ "period",  1, 0, 'p' },
+			{ "priority", 1, 0, 'P' },
+			{ "cpu",     1, 0, 'c' },
+			{ "mlock",   0, 0, 'm' },
+			{ "alert",   1, 0, 'a' },
+			{ "threshold", 1, 0, 'T' },
 			{ NULL, 0, 0, 0 },
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "D:s:d:b:lHOLC3NR", lopts, NULL);
+		c = getopt_long(argc, argv, "D:s:d:b:lHOLC3NRo:n:r:S:p:P:c:ma:T:", lopts, NULL);
 
 		if (c == -1)
 			break;
 
 		switch (c) {
 		case 'D':
-			device = optarg;
+			if (num_devices == MAX_DEVICES)
+				print_usage(argv[0]);
+			devices[num_devices++] = optarg;
 			break;
 		case 's':
 			speed = atoi(optarg);
@@ -176,73 +194,233 @@ static void parse_opts(int argc, char *argv[])
 		case 'R':
 			mode |= SPI_READY;
 			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'n':
+			num_samples = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			recording = optarg;
+			break;
+		case 'S':
+			shm_name = optarg;
+			break;
+		case 'p':
+			period_us = atoi(optarg);
+			realtime = true;
+			break;
+		case 'P':
+			rt.priority = atoi(optarg);
+			realtime = true;
+			break;
+		case 'c':
+			rt.cpu = atoi(optarg);
+			realtime = true;
+			break;
+		case 'm':
+			rt.lock_memory = true;
+			realtime = true;
+			break;
+		case 'a': {
+			char *colon = strrchr(optarg, ':');
+			if (!colon)
+				print_usage(argv[0]);
+			*colon = 0;
+			alert_chip = optarg;
+			alert_line = atoi(colon + 1);
+			break;
+		}
+		case 'T':
+			alert_mT = atof(optarg);
+			break;
 		default:
 			print_usage(argv[0]);
 			break;
 		}
 	}
+
+	/* the real-time runner needs something to run */
+	if (realtime && num_samples == 0) {
+		fprintf(stderr, "-p, -P, -c and -m need -n of at least 1\n");
+		print_usage(argv[0]);
+	}
 }
 
-int main(int argc, char *argv[])
+static void sensor_path(char *path, size_t size, const char *base, int i)
 {
-	int ret = 0;
-	int fd = -1;
+	if (num_devices > 1)
+		snprintf(path, size, "%s.%d", base, i);
+	else
+		snprintf(path, size, "%s", base);
+}
 
-	parse_opts(argc, argv);
+/* a fresh read_sample() is five frames, the set up before sampling a few more */
+static const uint64_t FRAMES_PER_SAMPLE = 5;
+static const uint64_t SETUP_FRAMES = 64;
 
-	mode |= SPI_MODE_0;
-	mode &= ~SPI_LSB_FIRST;
+static void reserve(TMAG5170Q1::SpidevTransport &) {}
 
-	fd = open(device, O_RDWR);
-	if (fd < 0)
-		pabort("can't open device");
+/* the run loop must not allocate, the recording gets all its room up front */
+static void reserve(TMAG5170Q1::RecordingTransport<TMAG5170Q1::SpidevTransport> &transport)
+{
+	transport.reserve(num_samples * FRAMES_PER_SAMPLE + SETUP_FRAMES);
+}
 
-	/*
-	 * spi mode
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
-	if (ret == -1)
-		pabort("can't set spi mode");
+static void save(TMAG5170Q1::SpidevTransport &, int) {}
 
-	ret = ioctl(fd, SPI_IOC_RD_MODE, &mode);
-	if (ret == -1)
-		pabort("can't get spi mode");
+static void save(TMAG5170Q1::RecordingTransport<TMAG5170Q1::SpidevTransport> &transport, int i)
+{
+	char path[256];
+	sensor_path(path, sizeof(path), recording, i);
+	if (!transport.save(path))
+		pabort("can't save recording");
+	if (transport.dropped())
+		fprintf(stderr, "%s: %llu frames not recorded\n", path, (unsigned long long)transport.dropped());
+}
 
-	/*
-	 * bits per word
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		pabort("can't set bits per word");
+/* frames are only printed when no capture file or bus is written */
+template <class Transport, class Trace>
+static int capture(TMAG5170Q1::SpiBus &bus)
+{
+	typedef TMAG5170Q1::TMAG5170Q1DeviceT<Transport, Trace> Device;
+	std::vector<Device> sensors;
+	TMAG5170Q1::BusScheduler<Device> scheduler(bus);
 
-	ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
-	if (ret == -1)
-		pabort("can't get bits per word");
+	for (int i = 0; i < num_devices; i++) {
+		sensors.emplace_back(Transport(TMAG5170Q1::SpidevTransport(bus, i)));
+		reserve(sensors.back().transport_);
+	}
 
-	/*
-	 * max speed hz
-	 */
-	ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		pabort("can't set max speed hz");
+	for (int i = 0; i < num_devices; i++) {
+		sensors[i].test_frame();
+		scheduler.attach(i, sensors[i]);
+	}
 
-	ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
-	if (ret == -1)
-		pabort("can't get max speed hz");
+	/* lock before mapping the capture files, they keep themselves unlocked */
+	TMAG5170Q1::RtConfig config = rt;
+	if (realtime && config.lock_memory) {
+		if (!TMAG5170Q1::RtRunner::lock_memory())
+			pabort("can't lock memory");
+		config.lock_memory = false;
+	}
 
-	printf("spi mode: %d\n", mode);
-	printf("bits per word: %d\n", bits);
-	printf("max speed: %d Hz (%d KHz)\n", speed, speed/1000);
+	std::vector<TMAG5170Q1::CaptureWriter> files(output ? num_devices : 0);
+	for (int i = 0; i < (int)files.size(); i++) {
+		char path[256];
+		sensor_path(path, sizeof(path), output, i);
+		if (!files[i].open(path, num_samples, sensors[i].datamem))
+			pabort(files[i].error());
+	}
 
-	//transfer(fd);
-    open_fd = fd;
+	std::vector<TMAG5170Q1::ShmPublisher> buses(shm_name ? num_devices : 0);
+	for (int i = 0; i < (int)buses.size(); i++) {
+		char name[256];
+		sensor_path(name, sizeof(name), shm_name, i);
+		if (!buses[i].open(name, 4096, sensors[i].datamem))
+			pabort(buses[i].error());
+	}
 
-    TMAG5170Q1::TMAG5170Q1Device dev;
-    dev.test_frame();
+	std::vector<TMAG5170Q1::Sample> samples(num_devices);
+	uint64_t n = 0;
+	auto poll = [&] {
+		scheduler.poll(samples.data());
+		for (int i = 0; i < (int)files.size(); i++)
+			files[i].append(samples[i]);
+		for (int i = 0; i < (int)buses.size(); i++)
+			buses[i].publish(samples[i]);
+		return ++n < num_samples;
+	};
+	if (realtime) {
+		TMAG5170Q1::RtRunner runner;
+		if (!runner.start(config, std::chrono::microseconds(period_us), poll))
+			pabort(runner.error());
+		runner.wait();
+		runner.stats().print(stderr, int64_t(period_us) * 1000);
+	} else if (num_samples > 0) {
+		while (poll()) {
+		}
+	}
+	for (int i = 0; i < num_devices; i++)
+		save(sensors[i].transport_, i);
+	if (!output && !shm_name) {
+		for (int i = 0; i < num_devices; i++) {
+			printf("%s: x=%d y=%d z=%d temp=%d fresh=%d\n", devices[i],
+				samples[i].x_, samples[i].y_, samples[i].z_, samples[i].temp_, samples[i].fresh_);
+		}
+	}
+	return 0;
+}
+
+/* first sensor only, default ranges */
+static int alerts(TMAG5170Q1::SpiBus &bus)
+{
+	typedef TMAG5170Q1::TMAG5170Q1DeviceT<TMAG5170Q1::SpidevTransport> Device;
+	Device sensor(TMAG5170Q1::SpidevTransport(bus, 0));
+	TMAG5170Q1::GpioAlertPin pin;
+	if (!pin.open(alert_chip, alert_line))
+		pabort(pin.error());
+
+	TMAG5170Q1::AlertMonitor<Device, TMAG5170Q1::GpioAlertPin> monitor(sensor, pin);
+	float range = TMAG5170Q1::range_mT(0);
+	int8_t high = TMAG5170Q1::threshold_code(alert_mT, range);
+	int8_t low = TMAG5170Q1::threshold_code(-alert_mT, range);
+	monitor.set_threshold(Device::X_THRX_CONFIG, low, high);
+	monitor.set_threshold(Device::Y_THRX_CONFIG, low, high);
+	monitor.set_threshold(Device::Z_THRX_CONFIG, low, high);
+	if (!monitor.configure(TMAG5170Q1::ALERT_X | TMAG5170Q1::ALERT_Y | TMAG5170Q1::ALERT_Z))
+		pabort(monitor.error());
+
+	TMAG5170Q1::AlertEvent event;
+	for (uint64_t n = 0; n < num_samples; n++) {
+		if (monitor.wait(event, -1) < 0)
+			pabort(monitor.error());
+		printf("%s: alert axes=%x x=%d y=%d z=%d temp=%d\n", devices[0], event.axes_,
+			event.sample_.x_, event.sample_.y_, event.sample_.z_, event.sample_.temp_);
+	}
+	return 0;
+}
 
+int main(int argc, char *argv[])
+{
+	int ret = 0;
 
+	parse_opts(argc, argv);
+
+	if (num_devices == 0)
+		devices[num_devices++] = "/dev/spidev0.0";
+
+	mode |= SPI_MODE_0;
+	mode &= ~SPI_LSB_FIRST;
+
+	TMAG5170Q1::SpiBus bus;
+	for (int i = 0; i < num_devices; i++) {
+		TMAG5170Q1::SpiConfig config;
+		config.mode = mode;
+		config.bits = bits;
+		config.speed = speed;
+		config.delay = delay;
+
+		if (bus.add(devices[i], config) < 0)
+			pabort(bus.error());
+
+		printf("%s\n", devices[i]);
+		printf("spi mode: %d\n", config.mode);
+		printf("bits per word: %d\n", config.bits);
+		printf("max speed: %d Hz (%d KHz)\n", config.speed, config.speed/1000);
+	}
 
-	close(fd);
+	typedef TMAG5170Q1::RecordingTransport<TMAG5170Q1::SpidevTransport> Recorder;
+	if (alert_chip)
+		ret = alerts(bus);
+	else if (recording && (output || shm_name))
+		ret = capture<Recorder, TMAG5170Q1::NoTrace>(bus);
+	else if (recording)
+		ret = capture<Recorder, TMAG5170Q1::PrintfTrace>(bus);
+	else if (output || shm_name)
+		ret = capture<TMAG5170Q1::SpidevTransport, TMAG5170Q1::NoTrace>(bus);
+	else
+		ret = capture<TMAG5170Q1::SpidevTransport, TMAG5170Q1::PrintfTrace>(bus);
 
 	return ret;
 }
@@ -0,0 +1,255 @@
+#ifndef TMAG5170Q1_RT_RUNNER
+#define TMAG5170Q1_RT_RUNNER
+#include <alloca.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <thread>
+#include "../library/tmag_thread.h"
+
+namespace TMAG5170Q1 {
+
+struct RtConfig {
+    int priority = 0;           // SCHED_FIFO priority 1..99, 0 stays SCHED_OTHER
+    int cpu = -1;               // core to pin to (ideally isolcpus), -1 any
+    bool lock_memory = false;   // lock_memory() in start()
+    size_t stack_prefault = 256 * 1024;
+};
+
+// Timing of a periodic run, all in ns
+struct RtStats {
+    uint64_t cycles_ = 0;
+    uint64_t overruns_ = 0;     // deadlines missed because work ran too long
+    int64_t period_min_ = 0;    // between consecutive wakeups
+    int64_t period_max_ = 0;
+    double period_mean_ = 0;
+    double period_m2_ = 0;      // running sum of squares for stddev
+    int64_t latency_max_ = 0;   // wakeup after deadline
+    int64_t work_max_ = 0;      // time spent in work
+
+    double period_stddev() const {
+        return cycles_ > 2 ? std::sqrt(period_m2_ / (cycles_ - 2)) : 0.0;
+    }
+
+    // Worst deviation from the requested period
+    int64_t jitter(int64_t period) const {
+        return std::max(period_max_ - period, period - period_min_);
+    }
+
+    void print(FILE* f, int64_t period) const {
+        fprintf(f, "cycles %llu overruns %llu\n", (unsigned long long)cycles_, (unsigned long long)overruns_);
+        fprintf(f, "period min %lld mean %.0f max %lld stddev %.0f ns, jitter %lld ns\n",
+                (long long)period_min_, period_mean_, (long long)period_max_, period_stddev(),
+                (long long)jitter(period));
+        fprintf(f, "latency max %lld ns, work max %lld ns\n", (long long)latency_max_, (long long)work_max_);
+    }
+};
+
+// Runs work once per period on a dedicated thread, optionally SCHED_FIFO,
+// pinned to one core and with all memory locked. Deadlines are absolute
+// CLOCK_MONOTONIC times, so a late wakeup does not shift the following
+// ones. work returns false to end the run. It owns whatever it touches
+// (the SpiBus fds, the devices) for the duration of the run and should not
+// allocate, so everything has to exist before start().
+//
+//   RtRunner runner;
+//   runner.start(config, std::chrono::microseconds(500), [&] {
+//       scheduler.poll(samples);
+//       return ++n < count;
+//   });
+//   runner.wait();
+//   runner.stats().print(stdout, 500000);
+class RtRunner {
+public:
+    typedef std::function<bool()> Work;
+
+    ~RtRunner() {
+        stop();
+    }
+
+    // Returns false with errno set and error() naming the step that failed,
+    // in which case work never ran
+    bool start(const RtConfig& config, std::chrono::nanoseconds period, Work work) {
+        if (thread_.joinable()) {
+            error_ = "already running";
+            errno = EBUSY;
+            return false;
+        }
+        if (config.lock_memory && !lock_memory()) {
+            error_ = "can't lock memory";
+            return false;
+        }
+        work_ = std::move(work);
+        period_ = period.count();
+        stats_ = RtStats();
+        running_.store(true, std::memory_order_relaxed);
+        setup_.store(SETUP_PENDING, std::memory_order_relaxed);
+        thread_ = std::thread([this, config] { run(config); });
+
+        int state;
+        while ((state = setup_.load(std::memory_order_acquire)) == SETUP_PENDING) {
+            std::this_thread::yield();
+        }
+        if (state != SETUP_OK) {
+            thread_.join();
+            errno = setup_errno_;
+            return false;
+        }
+        return true;
+    }
+
+    // mlockall of current and future pages. Where MCL_ONFAULT exists pages
+    // are locked as they are touched instead of all populated at once, so
+    // large file mappings such as a capture don't have to fit in RAM and can
+    // munlock() themselves. Call it before creating those mappings, with
+    // lock_memory unset in the RtConfig, otherwise start() locks late.
+    static bool lock_memory() {
+        int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+        flags |= MCL_ONFAULT;
+#endif
+        return mlockall(flags) == 0;
+    }
+
+    // Blocks until work returns false
+    void wait() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void stop() {
+        running_.store(false, std::memory_order_relaxed);
+        wait();
+    }
+
+    // Consistent once the run has ended
+    const RtStats& stats() const {
+        return stats_;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+private:
+    enum { SETUP_PENDING, SETUP_OK, SETUP_FAILED };
+
+    static int64_t to_ns(const timespec& t) {
+        return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+    }
+
+    static timespec from_ns(int64_t ns) {
+        timespec t;
+        t.tv_sec = ns / 1000000000;
+        t.tv_nsec = ns % 1000000000;
+        return t;
+    }
+
+    static int64_t monotonic_ns() {
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return to_ns(t);
+    }
+
+    bool fail(const char* what, int err) {
+        error_ = what;
+        setup_errno_ = err;
+        setup_.store(SETUP_FAILED, std::memory_order_release);
+        return false;
+    }
+
+    bool setup(const RtConfig& config) {
+        ThreadPlacement placement;
+        placement.cpu = config.cpu;
+        placement.priority = config.priority;
+        const char* what = "";
+        int err = place_thread(placement, &what);
+        if (err != 0) {
+            return fail(what, err);
+        }
+        // Touch the stack now so the loop never faults a page in
+        if (config.stack_prefault > 0) {
+            volatile char* stack = static_cast<volatile char*>(alloca(config.stack_prefault));
+            for (size_t i = 0; i < config.stack_prefault; i += 4096) {
+                stack[i] = 0;
+            }
+        }
+        setup_.store(SETUP_OK, std::memory_order_release);
+        return true;
+    }
+
+    void run(const RtConfig& config) {
+        if (!setup(config)) {
+            return;
+        }
+        RtStats& s = stats_;
+        int64_t deadline = monotonic_ns();
+        int64_t previous = 0;
+        while (running_.load(std::memory_order_relaxed)) {
+            int64_t wakeup = monotonic_ns();
+            int64_t late = wakeup - deadline;
+            if (late > s.latency_max_) {
+                s.latency_max_ = late;
+            }
+            if (s.cycles_ > 0) {
+                int64_t period = wakeup - previous;
+                if (s.cycles_ == 1 || period < s.period_min_) {
+                    s.period_min_ = period;
+                }
+                if (period > s.period_max_) {
+                    s.period_max_ = period;
+                }
+                double delta = period - s.period_mean_;
+                s.period_mean_ += delta / s.cycles_;
+                s.period_m2_ += delta * (period - s.period_mean_);
+            }
+            previous = wakeup;
+            s.cycles_++;
+
+            bool more = work_();
+            int64_t done = monotonic_ns();
+            if (done - wakeup > s.work_max_) {
+                s.work_max_ = done - wakeup;
+            }
+            if (!more) {
+                break;
+            }
+            if (period_ <= 0) {
+                deadline = done;
+                continue;
+            }
+
+            deadline += period_;
+            if (done > deadline) {
+                // Skip the missed slots instead of bursting to catch up
+                int64_t missed = (done - deadline) / period_ + 1;
+                s.overruns_ += missed;
+                deadline += missed * period_;
+            }
+            timespec t = from_ns(deadline);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, nullptr) == EINTR) {
+            }
+        }
+    }
+
+    Work work_;
+    int64_t period_ = 0;
+    RtStats stats_;
+    std::atomic<bool> running_{false};
+    std::atomic<int> setup_{SETUP_PENDING};
+    int setup_errno_ = 0;
+    std::thread thread_;
+    const char* error_ = "";
+};
+
+}
+
+#endif //#ifndef TMAG5170Q1_RT_RUNNER
@@ -0,0 +1,244 @@
+#ifndef TMAG5170Q1_SPI_BUS
+#define TMAG5170Q1_SPI_BUS
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#include <vector>
+
+#include "../library/tmag_sensor.h"
+#include "../library/tmag_stream.h"
+
+namespace TMAG5170Q1 {
+
+struct SpiConfig {
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    uint32_t speed = 100000;
+    uint16_t delay = 0;
+};
+
+// Owns the spidev fds of several chip selects on one SPI host.
+// Each chip select is its own /dev/spidevB.C node, so a single
+// SPI_IOC_MESSAGE can only batch frames of one sensor.
+//
+// Devices use it through SpidevTransport. Alternatively define TMAG5170Q1_SPIDEV_TRANSPORT
+// in exactly one translation unit, the TMAG_TransferFrame hooks then talk to the
+// selected channel.
+class SpiBus {
+public:
+    // Frames per SPI_IOC_MESSAGE, well below the ioctl size limit
+    static const size_t MAX_BATCH_FRAMES = 64;
+
+    ~SpiBus() {
+        if (active() == this) {
+            active() = nullptr;
+        }
+        for (Channel& channel : channels_) {
+            close(channel.fd_);
+        }
+    }
+
+    // Opens and configures a chip select. Returns the channel index, or -1
+    // with errno set and error() naming the step that failed. config is
+    // updated with what the driver reports back.
+    int add(const char* device, SpiConfig& config) {
+        Channel channel;
+        channel.fd_ = open(device, O_RDWR);
+        if (channel.fd_ < 0) {
+            error_ = "can't open device";
+            return -1;
+        }
+        if (!setup(channel.fd_, config)) {
+            int err = errno;
+            close(channel.fd_);
+            errno = err;
+            return -1;
+        }
+        channel.config_ = config;
+        channels_.push_back(channel);
+        return int(channels_.size() - 1);
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+    size_t size() const {
+        return channels_.size();
+    }
+
+    int fd(int channel) const {
+        return channels_[channel].fd_;
+    }
+
+    // count frames on one chip select, CS toggled between frames.
+    // Returns false if an ioctl fails.
+    bool transfer(int channel, const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        const Channel& c = channels_[channel];
+        struct spi_ioc_transfer tr[MAX_BATCH_FRAMES];
+
+        while (count > 0) {
+            size_t n = count < MAX_BATCH_FRAMES ? count : MAX_BATCH_FRAMES;
+
+            memset(tr, 0, sizeof(tr[0]) * n);
+            for (size_t i = 0; i < n; i++) {
+                tr[i].tx_buf = (unsigned long)tx[i];
+                tr[i].rx_buf = (unsigned long)rx[i];
+                tr[i].len = sizeof(uint8_t) * 4;
+                tr[i].speed_hz = c.config_.speed;
+                tr[i].delay_usecs = c.config_.delay;
+                tr[i].bits_per_word = c.config_.bits;
+                // deassert CS after every frame but the last
+                tr[i].cs_change = (i + 1 < n);
+            }
+
+            if (ioctl(c.fd_, SPI_IOC_MESSAGE(n), tr) < 1) {
+                error_ = "can't send spi message";
+                return false;
+            }
+
+            tx += n;
+            rx += n;
+            count -= n;
+        }
+        return true;
+    }
+
+    // Routes TMAG_TransferFrame/TMAG_TransferFrames to channel
+    void select(int channel) {
+        active() = this;
+        active_channel_ = channel;
+    }
+
+    int selected() const {
+        return active_channel_;
+    }
+
+    static SpiBus*& active() {
+        static SpiBus* bus = nullptr;
+        return bus;
+    }
+
+private:
+    struct Channel {
+        int fd_;
+        SpiConfig config_;
+    };
+
+    bool setup(int fd, SpiConfig& config) {
+        if (ioctl(fd, SPI_IOC_WR_MODE, &config.mode) == -1) {
+            error_ = "can't set spi mode";
+            return false;
+        }
+        if (ioctl(fd, SPI_IOC_RD_MODE, &config.mode) == -1) {
+            error_ = "can't get spi mode";
+            return false;
+        }
+        if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &config.bits) == -1) {
+            error_ = "can't set bits per word";
+            return false;
+        }
+        if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &config.bits) == -1) {
+            error_ = "can't get bits per word";
+            return false;
+        }
+        if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &config.speed) == -1) {
+            error_ = "can't set max speed hz";
+            return false;
+        }
+        if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &config.speed) == -1) {
+            error_ = "can't get max speed hz";
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<Channel> channels_;
+    int active_channel_ = 0;
+    const char* error_ = "";
+};
+
+// Device transport for one chip select of a SpiBus, aborts if an ioctl fails
+class SpidevTransport {
+public:
+    SpidevTransport() {}
+    SpidevTransport(SpiBus& bus, int channel) : bus_(&bus), channel_(channel) {}
+
+    void transfer(const uint8_t tx[4], uint8_t rx[4]) {
+        transfer(reinterpret_cast<const uint8_t(*)[4]>(tx), reinterpret_cast<uint8_t(*)[4]>(rx), 1);
+    }
+
+    void transfer(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+        if (!bus_ || !bus_->transfer(channel_, tx, rx, count)) {
+            perror(bus_ ? bus_->error() : "no spi bus");
+            abort();
+        }
+    }
+
+private:
+    SpiBus* bus_ = nullptr;
+    int channel_ = 0;
+};
+
+// Round robin sampling of one TMAG5170Q1 per chip select.
+// Every poll() reads X/Y/Z/TEMP from each sensor in turn with read_sample(),
+// at most two ioctls per sensor. The channel is selected before each device
+// so devices on ExternTransport work as well as ones on SpidevTransport.
+template <class Device>
+class BusScheduler {
+public:
+    explicit BusScheduler(SpiBus& bus) : bus_(bus) {}
+
+    void attach(int channel, Device& device) {
+        Entry entry = { channel, &device, SetCountTracker() };
+        entries_.push_back(entry);
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+    // samples[i] receives the result of the i:th attached device. Sensors
+    // without a new conversion cost one frame and keep their previous
+    // sample, tagged as not fresh.
+    void poll(Sample* samples) {
+        for (size_t i = 0; i < entries_.size(); i++) {
+            bus_.select(entries_[i].channel_);
+            read_sample(*entries_[i].device_, samples[i], entries_[i].tracker_);
+        }
+    }
+
+private:
+    struct Entry {
+        int channel_;
+        Device* device_;
+        SetCountTracker tracker_;
+    };
+
+    SpiBus& bus_;
+    std::vector<Entry> entries_;
+};
+
+}
+
+#ifdef TMAG5170Q1_SPIDEV_TRANSPORT
+void TMAG_TransferFrame(const uint8_t tx[4], uint8_t rx[4]) {
+    TMAG_TransferFrames(reinterpret_cast<const uint8_t(*)[4]>(tx), reinterpret_cast<uint8_t(*)[4]>(rx), 1);
+}
+
+void TMAG_TransferFrames(const uint8_t tx[][4], uint8_t rx[][4], size_t count) {
+    TMAG5170Q1::SpiBus* bus = TMAG5170Q1::SpiBus::active();
+    if (!bus || !bus->transfer(bus->selected(), tx, rx, count)) {
+        perror(bus ? bus->error() : "no spi bus selected");
+        abort();
+    }
+}
+#endif
+
+#endif //#ifndef TMAG5170Q1_SPI_BUS